@@ -1,17 +1,25 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bawrite to start the write and bwait to finish it.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Each buffer lives in the bucket that (dev, blockno) hashes to,
+// and each bucket has its own lock, so lookups of different
+// blocks on different CPUs don't contend. A miss must recycle
+// the least recently used unreferenced buffer, which may be in
+// any bucket; bcache.lock serializes misses so that only one
+// CPU at a time ever holds more than one bucket lock.
 
 
 #include "types.h"
@@ -23,69 +31,175 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+#define HASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+struct bucket {
   struct spinlock lock;
+  struct buf head;  // circular list through prev/next.
+  // counters, protected by lock.
+  uint nhit;        // lookups found in this bucket
+  uint nmiss;       // lookups that recycled a buffer into it
+  uint nsteal;      // ... taking it from another bucket
+};
+
+struct {
+  struct spinlock lock; // held while recycling a buffer
   struct buf buf[NBUF];
+  uchar data[NBUF][BSIZE]; // buf[i].data
+  struct bucket bucket[NBUCKET];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // readahead, updated atomically.
+  int rainflight;       // readahead reads at the disk
+  uint raissue;         // readahead reads started
+  uint rahit;           // ... later used by bread()
+  uint rawaste;         // ... recycled without being used
+  uint raskip;          // not started, too many in flight
 } bcache;
 
+// at most this many buffers can be tied up by readahead
+// at once, so that it can't starve bread() of buffers.
+#define RAINFLIGHT (NBUF/4)
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+blink(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+
+  // Spread the (not yet valid) buffers over the buckets.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = bcache.data[b - bcache.buf];
+    blink(&bcache.bucket[(b - bcache.buf) % NBUCKET], b);
   }
 }
 
+// Look for block (dev, blockno) in bucket bk.
+// If found, take a reference to it.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      bk->nhit++;
+      return b;
+    }
+  }
+  return 0;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// Returns 0 if every buffer is in use.
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *victim;
+  struct bucket *bk, *vbk, *obk;
+  int found;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[HASH(dev, blockno)];
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Only one CPU at a time recycles buffers; check again
+  // in case another CPU cached the block while we waited.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Find the least recently used unused buffer in any bucket,
+  // keeping the lock of the bucket that holds the best
+  // candidate so far, so that it can't be taken meanwhile.
+  victim = 0;
+  vbk = 0;
+  for(obk = bcache.bucket; obk < bcache.bucket+NBUCKET; obk++){
+    acquire(&obk->lock);
+    found = 0;
+    for(b = obk->head.next; b != &obk->head; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(vbk)
+        release(&vbk->lock);
+      vbk = obk;
+    } else {
+      release(&obk->lock);
     }
   }
-  panic("bget: no buffers");
+  if(victim == 0){
+    release(&bcache.lock);
+    return 0;
+  }
+  if(victim->ra){
+    __sync_fetch_and_add(&bcache.rawaste, 1);
+    victim->ra = 0;
+  }
+
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  if(vbk != bk){
+    bunlink(victim);
+    vbk->nsteal++;
+    release(&vbk->lock);
+    acquire(&bk->lock);
+    blink(bk, victim);
+  }
+  bk->nmiss++;
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,14 +208,126 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  if((b = bget(dev, blockno)) == 0)
+    panic("bget: no buffers");
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
+  if(b->ra){
+    __sync_fetch_and_add(&bcache.rahit, 1);
+    b->ra = 0;
+  }
   return b;
 }
 
+// Called by the disk interrupt handler when a read started
+// by breadahead() finishes. Does brelse()'s job on behalf of
+// the process that started it.
+static void
+breaddone(struct buf *b)
+{
+  struct bucket *bk;
+
+  b->valid = 1;
+  b->iodone = 0;
+  releasesleep(&b->lock);
+  __sync_fetch_and_sub(&bcache.rainflight, 1);
+
+  bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->lastuse = ticks;
+  release(&bk->lock);
+}
+
+// Start reading block blockno into the cache, unless it's
+// there already, without waiting for it. The read reaches
+// the disk at the next bsubmit() or disk wait, together
+// with adjacent ones started meanwhile.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = &bcache.bucket[HASH(dev, blockno)];
+  acquire(&bk->lock);
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bk->lock);
+      return;
+    }
+  }
+  release(&bk->lock);
+
+  if(__sync_fetch_and_add(&bcache.rainflight, 1) >= RAINFLIGHT){
+    __sync_fetch_and_sub(&bcache.rainflight, 1);
+    __sync_fetch_and_add(&bcache.raskip, 1);
+    return;
+  }
+  if((b = bget(dev, blockno)) == 0 || b->valid){
+    // no buffer to spare, or someone else read it meanwhile.
+    __sync_fetch_and_sub(&bcache.rainflight, 1);
+    if(b)
+      brelse(b);
+    return;
+  }
+  __sync_fetch_and_add(&bcache.raissue, 1);
+  b->ra = 1;
+  b->iodone = breaddone;
+  virtio_disk_start(b, 0);
+}
+
+// Read n blocks of dev into memory outside the buffer cache:
+// block b[i].blockno to b[i].data, using the rest of b[i]
+// for the disk request. For file data, which the page cache
+// holds, so that it doesn't push metadata out of the buffer
+// cache. A block that is in the buffer cache is copied from
+// there instead, since it is newer than the disk until the
+// log installs it. Starts all the reads before waiting for
+// any, so that the disk driver can merge adjacent ones.
+void
+breadraw(uint dev, struct buf *b, int n)
+{
+  struct bucket *bk;
+  struct buf *c;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b[i].dev = dev;
+    b[i].valid = 0;
+    b[i].iodone = 0;
+    bk = &bcache.bucket[HASH(dev, b[i].blockno)];
+    acquire(&bk->lock);
+    for(c = bk->head.next; c != &bk->head; c = c->next){
+      if(c->dev == dev && c->blockno == b[i].blockno && c->valid){
+        memmove(b[i].data, c->data, BSIZE);
+        b[i].valid = 1;
+        bk->nhit++;
+        break;
+      }
+    }
+    release(&bk->lock);
+    if(!b[i].valid)
+      virtio_disk_start(&b[i], 0);
+  }
+  for(i = 0; i < n; i++){
+    if(!b[i].valid){
+      virtio_disk_wait(&b[i]);
+      b[i].valid = 1;
+    }
+  }
+}
+
+// Send reads started by breadahead() to the disk.
+void
+bsubmit(void)
+{
+  virtio_disk_submit();
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +337,104 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, without waiting.
+// Must be locked, and must stay locked until bwait(b).
+// Writes of adjacent blocks started before the first
+// bwait() go to the disk as one request.
+void
+bawrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for a write started by bawrite() to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it was last used, for LRU recycling.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    b->lastuse = ticks;
+  }
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Drop the reference that bpin() took on the cached copy
+// of block (dev, blockno). Doesn't lock the buffer, so the
+// log can unpin a block that the caller has locked.
 void
-bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+bunpin(uint dev, uint blockno) {
+  struct bucket *bk = &bcache.bucket[HASH(dev, blockno)];
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  }
+  if(b == &bk->head || b->refcnt < 1)
+    panic("bunpin");
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Format readahead counters for the statistics device.
+int
+rastats(char *buf, int sz)
+{
+  return snprintf(buf, sz,
+                  "--- readahead\nissue %d hit %d waste %d skip %d inflight %d\n",
+                  bcache.raissue, bcache.rahit, bcache.rawaste,
+                  bcache.raskip, bcache.rainflight);
+}
+
+// Format buffer cache counters for the statistics device.
+int
+bcachestats(char *buf, int sz)
+{
+  struct bucket *bk;
+  uint hit = 0, miss = 0, steal = 0;
+  int n;
 
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    hit += bk->nhit;
+    miss += bk->nmiss;
+    steal += bk->nsteal;
+  }
+  n = snprintf(buf, sz, "--- bcache\nhit %d miss %d steal %d\n",
+               hit, miss, steal);
+  n += snprint_lock(buf+n, sz-n, &bcache.lock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    n += snprint_lock(buf+n, sz-n, &bk->lock);
+  return n;
+}
@@ -1,12 +1,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int dwrite;  // is the disk operation a write?
+  struct buf *qnext; // disk request queue
+  void (*iodone)(struct buf*); // if set, disk interrupt calls it when done
+  int ra;      // read ahead, and not yet used by bread()?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks when refcnt last fell to zero, for LRU
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;   // BSIZE bytes
 };
 
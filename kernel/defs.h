@@ -1,4 +1,5 @@
 struct buf;
+struct cpage;
 struct context;
 struct file;
 struct inode;
@@ -14,8 +15,15 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bawrite(struct buf*);
+void            bwait(struct buf*);
+void            breadahead(uint, uint);
+void            bsubmit(void);
+int             rastats(char*, int);
 void            bpin(struct buf*);
-void            bunpin(struct buf*);
+void            bunpin(uint, uint);
+void            breadraw(uint, struct buf*, int);
+int             bcachestats(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -33,11 +41,16 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int n);
+int             filetee(struct file*, struct file*, int n);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dcinit(void);
+void            dcforget(struct inode*, char*);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+struct buf*     ibread(struct inode*, uint);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
@@ -52,7 +65,11 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+struct cpage*   ipage(struct inode*, uint, uint, uint);
+void*           ipagemap(struct inode*, uint);
+void*           ipagepeek(struct inode*, uint);
 void            itrunc(struct inode*);
+int             fsstats(char*, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -62,19 +79,51 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kref(void *);
+int             krefcnt(void *);
+void*           kallocorder(int);
+void            kfreeorder(void *, int);
 void            kinit(void);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+int             logstats(char*, int);
+
+// mmap.c
+uint64          mmap(struct file*, uint64, int, int, uint);
+int             munmap(uint64, uint64);
+int             vmfault(struct proc*, uint64, int, int);
+void            vmprefault(uint64, uint64, int);
+uint64          mmapbase(struct proc*);
+int             mmapfork(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
+void            mmapshrink(struct proc*, uint64);
+
+// pcache.c
+void            pcinit(void);
+struct cpage*   pclookup(uint, uint, uint);
+struct cpage*   pcalloc(uint, uint, uint);
+void            pcput(struct cpage*);
+void            pcupdate(uint, uint, uint, void*, int);
+void            pcdrop(uint, uint);
+int             pcreclaim(void);
+int             pcachestats(char*, int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
+int             pipepeek(struct pipe*, int, uint64, int);
+int             pipemove(struct pipe*, struct pipe*, int);
+int             piperead_nb(struct pipe*, int, uint64, int);
+int             pipewrite_nb(struct pipe*, int, uint64, int);
+int             pipewait(struct pipe*, int);
+int             pipesize(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -104,6 +153,8 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            setrunnable(struct proc*);
+int             schedstats(char*, int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -115,6 +166,7 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             snprint_lock(char*, int, struct spinlock*);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -122,6 +174,15 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// start.c
+int             timertick(void);
+
+// stats.c
+void            statsinit(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -158,14 +219,20 @@ void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             mapsuper(pagetable_t, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmfault(pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+int             vmstats(char*, int);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -180,7 +247,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_submit(void);
 void            virtio_disk_intr(void);
+int             virtio_disk_stats(char*, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
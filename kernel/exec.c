@@ -6,20 +6,32 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "stat.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// max segments of a program that are paged in from
+// its file rather than read in by exec().
+#define NSEG 4
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+static int elfprot(int);
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
+  struct file *f = 0;
+  struct vma seg[NSEG];
 
   begin_op();
 
@@ -48,12 +60,37 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    if((ph.vaddr % PGSIZE) != 0)
+      goto bad;
+    if(ph.vaddr < PGROUNDUP(sz) || ph.vaddr + ph.memsz > TRAPFRAME)
+      goto bad;
+    if(ip->type == T_FILE && (ph.off % PGSIZE) == 0 && ph.memsz > 0 && nseg < NSEG){
+      // map the segment from the page cache, to be
+      // faulted in as the program runs.
+      if(f == 0){
+        if((f = filealloc()) == 0)
+          goto bad;
+        f->type = FD_INODE;
+        f->readable = 1;
+        f->writable = 0;
+        f->off = 0;
+        f->ip = idup(ip);
+      }
+      seg[nseg].addr = ph.vaddr;
+      seg[nseg].len = PGROUNDUP(ph.memsz);
+      seg[nseg].prot = elfprot(ph.flags);
+      seg[nseg].flags = MAP_PRIVATE;
+      seg[nseg].f = filedup(f);
+      seg[nseg].off = ph.off;
+      seg[nseg].flen = ph.filesz;
+      nseg++;
+      sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     sz = sz1;
-    if((ph.vaddr % PGSIZE) != 0)
-      goto bad;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
@@ -109,12 +146,17 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  mmapexit(p);
+  for(i = 0; i < nseg; i++)
+    p->vma[i] = seg[i];
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(f)
+    fileclose(f);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -125,9 +167,28 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  for(i = 0; i < nseg; i++)
+    fileclose(seg[i].f);
+  if(f)
+    fileclose(f);
   return -1;
 }
 
+// Convert ELF segment flags to mmap() protection.
+static int
+elfprot(int flags)
+{
+  int prot = PROT_NONE;
+
+  if(flags & ELF_PROG_FLAG_READ)
+    prot |= PROT_READ;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    prot |= PROT_WRITE;
+  if(flags & ELF_PROG_FLAG_EXEC)
+    prot |= PROT_EXEC;
+  return prot;
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
@@ -12,6 +12,8 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "buf.h"
+#include "pcache.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -111,8 +113,12 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // copyout() can't read in a mapped file page while the pipe
+  // or inode is locked.
+  vmprefault(addr, n, 1);
+
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
@@ -139,8 +145,10 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  vmprefault(addr, n, 0);  // see fileread()
+
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
@@ -180,3 +188,163 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+
+// Move up to n bytes from the file at f's offset into pipe pi,
+// straight from the page cache (the buffer cache for other
+// than regular files) into the pipe's ring, a page or block
+// at a time. Waits for room in the pipe without holding the
+// inode lock, then copies only what fits without sleeping.
+static int
+splicefrom(struct file *f, struct pipe *pi, int n)
+{
+  struct inode *ip = f->ip;
+  struct cpage *pg;
+  struct buf *bp;
+  int tot, m, r;
+
+  for(tot = 0; tot < n; tot += r){
+    if((r = pipewait(pi, 1)) < 0)
+      return tot > 0 ? tot : -1;
+    ilock(ip);
+    if(f->off >= ip->size){
+      iunlock(ip);
+      break;
+    }
+    m = n - tot;
+    if(m > ip->size - f->off)
+      m = ip->size - f->off;
+    if(ip->type == T_FILE && (pg = ipage(ip, f->off/PGSIZE, f->off, m)) != 0){
+      if(m > PGSIZE - f->off%PGSIZE)
+        m = PGSIZE - f->off%PGSIZE;
+      r = pipewrite_nb(pi, 0, (uint64)(pg->data + f->off%PGSIZE), m);
+      pcput(pg);
+    } else {
+      // as in readi(), the buffer cache is up to date for a
+      // page that isn't cached.
+      if(m > BSIZE - f->off%BSIZE)
+        m = BSIZE - f->off%BSIZE;
+      bp = ibread(ip, f->off);
+      r = pipewrite_nb(pi, 0, (uint64)(bp->data + f->off%BSIZE), m);
+      brelse(bp);
+    }
+    if(r > 0){
+      f->off += r;
+      ip->ranext = f->off / BSIZE;
+    }
+    iunlock(ip);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+  }
+  return tot;
+}
+
+// Move up to n bytes from pipe pi to the file at f's offset,
+// straight from the pipe's ring into the buffer cache, one
+// block per transaction.
+// Waits for data without holding the inode lock or a
+// transaction open, then takes only what is there.
+static int
+spliceto(struct pipe *pi, struct file *f, int n)
+{
+  struct inode *ip = f->ip;
+  struct buf *bp;
+  int tot, m, r;
+
+  for(tot = 0; tot < n; tot += r){
+    if((r = pipewait(pi, 0)) <= 0){
+      if(r < 0 && tot == 0)
+        return -1;
+      break;
+    }
+    begin_op();
+    ilock(ip);
+    m = n - tot;
+    if(m > BSIZE - f->off%BSIZE)
+      m = BSIZE - f->off%BSIZE;
+    if(f->off > ip->size || f->off + m > MAXFILE*BSIZE){
+      iunlock(ip);
+      end_op();
+      return tot > 0 ? tot : -1;
+    }
+    bp = ibread(ip, f->off);
+    r = piperead_nb(pi, 0, (uint64)(bp->data + f->off%BSIZE), m);
+    if(r > 0){
+      log_write(bp);
+      pcupdate(ip->dev, ip->inum, f->off, bp->data + f->off%BSIZE, r);
+      f->off += r;
+      if(f->off > ip->size)
+        ip->size = f->off;
+    }
+    brelse(bp);
+    // write the i-node back even if the size didn't change,
+    // since ibread() might have allocated a block.
+    iupdate(ip);
+    iunlock(ip);
+    end_op();
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+  }
+  return tot;
+}
+
+// Move up to n bytes from in to out, where at least one of
+// them is a pipe and the other is a pipe or a file, without
+// copying the data through user space.
+// Returns the number of bytes moved, 0 at end of file,
+// or -1 on error.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  int r;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  if(in->type == FD_INODE && out->type == FD_PIPE)
+    return splicefrom(in, out->pipe, n);
+  if(in->type == FD_PIPE && out->type == FD_INODE)
+    return spliceto(in->pipe, out, n);
+  if(in->type != FD_PIPE || out->type != FD_PIPE)
+    return -1;
+
+  // pipe to pipe waits for data and for room without holding
+  // either pipe, then moves what it can under both locks.
+  if(in->pipe == out->pipe)
+    return -1;
+  if(n == 0)
+    return 0;
+  for(;;){
+    if((r = pipewait(in->pipe, 0)) <= 0)
+      return r;
+    if(pipewait(out->pipe, 1) < 0)
+      return -1;
+    if((r = pipemove(in->pipe, out->pipe, n)) != 0)
+      return r;
+    // another reader took the data meanwhile.
+  }
+}
+
+// Copy up to n bytes from pipe in to pipe out,
+// leaving them in the first pipe as well.
+// Returns the number of bytes copied, 0 at end of file,
+// or -1 on error.
+int
+filetee(struct file *in, struct file *out, int n)
+{
+  char *buf;
+  int r;
+
+  if(in->type != FD_PIPE || out->type != FD_PIPE || in->pipe == out->pipe)
+    return -1;
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  if((buf = kalloc()) == 0)
+    return -1;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if((r = pipepeek(in->pipe, 0, (uint64)buf, n)) > 0)
+    r = pipewrite(out->pipe, 0, (uint64)buf, r);
+  kfree(buf);
+  return r;
+}
@@ -18,6 +18,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // next in hash bucket
+  struct inode *lprev; // LRU list of unreferenced inodes
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +29,14 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint indirect;
+  uint dindirect;
+  uint dindex;
+
+  uint ranext;        // block where the last readi() ended
+  uint raend;         // blocks before this have been read ahead
+  int rawin;          // readahead window, in blocks (pages for T_FILE)
 };
 
 // map major device number to device functions.
@@ -38,3 +48,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "pcache.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -37,6 +38,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +47,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
 }
 
 // Zero a block.
@@ -59,32 +63,154 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The free-block bitmap is summarized in memory by the number
+// of free blocks each bitmap block describes, so that balloc()
+// reads only bitmap blocks that it will find a free block in.
+// The counts change only while the bitmap block is locked, so
+// they always agree with the (cached) bitmap.
+//
+// balloc() takes a goal, usually the block after the file's
+// previous one, and allocates the first free block at or after
+// it, so that a file's blocks end up next to each other. With
+// no goal it continues from the last block it allocated.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define NBITMAP (FSSIZE/BPB + 1)
+
+struct {
+  struct spinlock lock;
+  uint nfree[NBITMAP]; // free blocks in each bitmap block's range
+  uint next;           // where to search when there is no goal
+  uint nalloc;         // blocks allocated
+  uint ngoal;          // ... exactly at their goal
+  uint nread;          // bitmap blocks read to find them
+} bsum;
+
+// Count the free blocks described by each bitmap block.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
+  int b, bi;
   struct buf *bp;
 
-  bp = 0;
+  initlock(&bsum.lock, "bsum");
+  if(sb.size > NBITMAP*BPB)
+    panic("bsuminit: file system too big");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[b/BPB]++;
     }
     brelse(bp);
   }
+}
+
+// Mark block b in use in bitmap block bp.
+static void
+bmark(struct buf *bp, uint b)
+{
+  int bi = b % BPB;
+
+  bp->data[bi/8] |= 1 << (bi % 8);
+  log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b/BPB]--;
+  bsum.nalloc++;
+  bsum.next = b + 1;
+  release(&bsum.lock);
+}
+
+// Allocate the first free block from b to the end of the
+// range of b's bitmap block. Returns 0 if there is none.
+static uint
+bsearch(uint dev, uint b)
+{
+  uint end;
+  int bi;
+  struct buf *bp;
+
+  end = min(b - b % BPB + BPB, sb.size);
+  bp = bread(dev, BBLOCK(b, sb));
+  for(; b < end; b++){
+    bi = b % BPB;
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+      b += 7;  // skip a byte of used blocks
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0){  // Is block free?
+      bmark(bp, b);
+      break;
+    }
+  }
+  brelse(bp);
+  acquire(&bsum.lock);
+  bsum.nread++;
+  release(&bsum.lock);
+  return b < end ? b : 0;
+}
+
+// Allocate a zeroed disk block, the first free one at or
+// after goal, or after the last one allocated if goal is 0.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, g, ng, i, n;
+
+  acquire(&bsum.lock);
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.next < sb.size ? bsum.next : 0;
+  release(&bsum.lock);
+
+  // the rest of goal's bitmap block, then the others,
+  // wrapping around to the start of goal's.
+  ng = (sb.size + BPB - 1) / BPB;
+  g = goal / BPB;
+  for(i = 0; i <= ng; i++){
+    acquire(&bsum.lock);
+    n = bsum.nfree[(g + i) % ng];
+    release(&bsum.lock);
+    if(n == 0)
+      continue;
+    b = bsearch(dev, i == 0 ? goal : (g + i) % ng * BPB);
+    if(b){
+      if(b == goal){
+        acquire(&bsum.lock);
+        bsum.ngoal++;
+        release(&bsum.lock);
+      }
+      bzero(dev, b);
+      return b;
+    }
+  }
   panic("balloc: out of blocks");
 }
 
+// Allocate block b if it is free, to grow an extent.
+// Returns b, or 0 if b is in use.
+static uint
+ballocat(uint dev, uint b)
+{
+  int bi;
+  struct buf *bp;
+
+  if(b >= sb.size)
+    return 0;
+  bp = bread(dev, BBLOCK(b, sb));
+  bi = b % BPB;
+  if(bp->data[bi/8] & (1 << (bi % 8))){
+    brelse(bp);
+    return 0;
+  }
+  bmark(bp, b);
+  brelse(bp);
+  acquire(&bsum.lock);
+  bsum.ngoal++;
+  release(&bsum.lock);
+  bzero(dev, b);
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -99,6 +225,9 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b/BPB]++;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -162,32 +291,167 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash on (dev, inum) with a lock per bucket,
+// so that lookups of different inodes don't contend. An
+// entry's bucket lock protects its ref and its place in the
+// bucket; ip->dev and ip->inum change only while the entry
+// is in no bucket. Entries whose ref has fallen to zero stay
+// in their bucket, still valid, on an LRU list (itable.lrulock)
+// so that a later iget() of a busy inode needn't read it from
+// disk again. iget() recycles the least recently used of them
+// on a miss, or, if every entry is referenced, grows the
+// table by a page of entries. itable.lock serializes misses.
+// Lock order: itable.lock, bucket lock, itable.lrulock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
-struct {
+#define NIBUCKET 31
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+
+struct ibucket {
   struct spinlock lock;
+  struct inode *head;   // chain through ip->hnext
+};
+
+struct {
+  struct spinlock lock;     // held while recycling an entry
   struct inode inode[NINODE];
+  struct ibucket bucket[NIBUCKET];
+  struct spinlock lrulock;
+  struct inode lru;         // unreferenced entries, oldest first,
+                            // circular through lprev/lnext.
+  int ninode;               // entries, including added pages
+  uint nhit;                // iget()s that found the inode
+  uint nmiss;               // ... that recycled an entry
 } itable;
 
+// The inode map at sb.imapstart has a bit per inode, set
+// while the inode is allocated, so that ialloc() can find a
+// free inode without reading the inode blocks. A bit changes
+// in the same transaction as the dinode's type.
+// imap.next is where the search for a free inode starts:
+// just past the last one allocated, or at one just freed.
+
+struct {
+  struct spinlock lock;
+  uint next;           // where to look for a free inode
+  uint nalloc;         // inodes allocated
+  uint nread;          // inode map blocks read to find them
+} imap;
+
+// Append ip to the LRU list.
+static void
+lruput(struct inode *ip)
+{
+  acquire(&itable.lrulock);
+  ip->lnext = &itable.lru;
+  ip->lprev = itable.lru.lprev;
+  itable.lru.lprev->lnext = ip;
+  itable.lru.lprev = ip;
+  release(&itable.lrulock);
+}
+
+// Remove ip from the LRU list.
+static void
+lrudel(struct inode *ip)
+{
+  acquire(&itable.lrulock);
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  ip->lprev = ip->lnext = 0;
+  release(&itable.lrulock);
+}
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&itable.lock, "itable");
+  initlock(&itable.lrulock, "itable.lru");
+  initlock(&imap.lock, "imap");
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&itable.bucket[i].lock, "itable.bucket");
+  itable.lru.lprev = &itable.lru;
+  itable.lru.lnext = &itable.lru;
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    lruput(&itable.inode[i]);
   }
+  itable.ninode = NINODE;
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void dcpurge(struct inode*);
+
+// Find a free inode in the inode map and mark it in use.
+// Returns its number, or 0 if there is none.
+static uint
+imapalloc(uint dev)
+{
+  uint inum, n, start;
+  int bi;
+  struct buf *bp;
+
+  acquire(&imap.lock);
+  start = imap.next;
+  release(&imap.lock);
+  if(start == 0 || start >= sb.ninodes)
+    start = 1;
+
+  bp = 0;
+  for(n = 0; n < sb.ninodes; n++){
+    inum = (start + n) % sb.ninodes;
+    if(bp == 0 || bp->blockno != IMBLOCK(inum, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IMBLOCK(inum, sb));
+      acquire(&imap.lock);
+      imap.nread++;
+      release(&imap.lock);
+    }
+    bi = inum % BPB;
+    if(bi % 8 == 0 && inum + 8 <= sb.ninodes && bp->data[bi/8] == 0xff){
+      n += 7;  // skip a byte of inodes in use
+      continue;
+    }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0){  // Is inode free?
+      bp->data[bi/8] |= 1 << (bi % 8);
+      log_write(bp);
+      brelse(bp);
+      acquire(&imap.lock);
+      imap.next = inum + 1;
+      imap.nalloc++;
+      release(&imap.lock);
+      return inum;
+    }
+  }
+  if(bp)
+    brelse(bp);
+  return 0;
+}
+
+// Mark inode inum free in the inode map.
+static void
+imapfree(uint dev, uint inum)
+{
+  int bi;
+  struct buf *bp;
+
+  bp = bread(dev, IMBLOCK(inum, sb));
+  bi = inum % BPB;
+  if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+    panic("freeing free inode");
+  bp->data[bi/8] &= ~(1 << (bi % 8));
+  log_write(bp);
+  brelse(bp);
+  acquire(&imap.lock);
+  if(inum < imap.next)
+    imap.next = inum;
+  release(&imap.lock);
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -195,23 +459,21 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
-  }
-  panic("ialloc: no inodes");
+  if((inum = imapalloc(dev)) == 0)
+    panic("ialloc: no inodes");
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -231,42 +493,143 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->indirect = ip->indirect;
+  dip->dindirect = ip->dindirect;
+  dip->dindex = ip->dindex;
   log_write(bp);
   brelse(bp);
 }
 
+// Look for inode (dev, inum) in bucket bk.
+// If found, take a reference to it.
+// Caller must hold bk->lock.
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lrudel(ip);
+      __sync_fetch_and_add(&itable.nhit, 1);
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Remove ip from the bucket it is in, if any.
+// Caller must hold that bucket's lock.
+static void
+iunhash(struct ibucket *bk, struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &bk->head; *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      break;
+    }
+  }
+  ip->hnext = 0;
+}
+
+// Add a page of entries to the table.
+// Caller must hold itable.lock.
+static int
+igrow(void)
+{
+  struct inode *ip;
+  char *pa;
+  int i;
+
+  if((pa = kalloc()) == 0)
+    return -1;
+  memset(pa, 0, PGSIZE);
+  for(i = 0; i < PGSIZE / sizeof(struct inode); i++){
+    ip = (struct inode*)pa + i;
+    initsleeplock(&ip->lock, "inode");
+    lruput(ip);
+    itable.ninode++;
+  }
+  return 0;
+}
+
+// Take the least recently used unreferenced entry out of
+// the table, growing the table if there is none.
+// Caller must hold itable.lock.
+static struct inode*
+ivictim(void)
+{
+  struct inode *ip;
+  struct ibucket *vbk;
+
+  for(;;){
+    acquire(&itable.lrulock);
+    ip = itable.lru.lnext;
+    release(&itable.lrulock);
+    if(ip == &itable.lru){
+      if(igrow() < 0)
+        panic("iget: no inodes");
+      continue;
+    }
+
+    // ip->dev and ip->inum can't change while we hold
+    // itable.lock, but ip may be taken by a hit meanwhile.
+    vbk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+    acquire(&vbk->lock);
+    if(ip->ref == 0){
+      lrudel(ip);
+      iunhash(vbk, ip);
+      release(&vbk->lock);
+      return ip;
+    }
+    release(&vbk->lock);
+  }
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  struct ibucket *bk;
 
-  acquire(&itable.lock);
+  bk = &itable.bucket[IHASH(dev, inum)];
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip)
+    return ip;
+
+  // Not in the table.
+  // Only one CPU at a time recycles entries; check again
+  // in case another CPU added the inode while we waited.
+  acquire(&itable.lock);
+  acquire(&bk->lock);
+  ip = ifind(bk, dev, inum);
+  release(&bk->lock);
+  if(ip){
+    release(&itable.lock);
+    return ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = ivictim();
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  acquire(&bk->lock);
+  ip->hnext = bk->head;
+  bk->head = ip;
+  release(&bk->lock);
+  itable.nmiss++;
   release(&itable.lock);
 
   return ip;
@@ -277,9 +640,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -295,6 +660,7 @@ ilock(struct inode *ip)
     panic("ilock");
 
   acquiresleep(&ip->lock);
+  myproc()->nilock++;
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -304,8 +670,14 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->indirect = dip->indirect;
+    ip->dindirect = dip->dindirect;
+    ip->dindex = dip->dindex;
     brelse(bp);
+    ip->ranext = 0;
+    ip->raend = 0;
+    ip->rawin = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -319,12 +691,13 @@ iunlock(struct inode *ip)
   if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  myproc()->nilock--;
   releasesleep(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, though it stays cached until it is.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,7 +705,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = &itable.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,20 +716,24 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    imapfree(ip->dev, ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&bk->lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(--ip->ref == 0)
+    lruput(ip);
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -368,42 +747,118 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk. The file's first blocks are
+// described by up to NEXTENT extents in ip->ext[], each a
+// run of consecutive disk blocks, so finding a block of a
+// file that was written sequentially usually takes no disk
+// reads at all. After the extents, block numbers are listed
+// in the indirect block ip->indirect, and then in the
+// indirect blocks listed in the doubly-indirect block
+// ip->dindirect. Files only grow at the end, so the extents
+// stop changing once the indirect blocks are in use.
+
+// Return entry i of the block of addresses *ap,
+// allocating the block and the entry if need be.
+// A new block of addresses is placed near goal, and a
+// new entry right after the one before it.
+static uint
+indirect(struct inode *ip, uint *ap, uint i, uint goal)
+{
+  uint addr, *a;
+  struct buf *bp;
+
+  // Load indirect block, allocating if necessary.
+  if((addr = *ap) == 0)
+    *ap = addr = balloc(ip->dev, goal);
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if(a[i] == 0){
+    goal = i > 0 && a[i-1] ? a[i-1] + 1 : addr + 1;
+    a[i] = balloc(ip->dev, goal);
+    log_write(bp);
+  }
+  addr = a[i];
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
-
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  uint addr, base, goal;
+  struct extent *e;
+  int i;
+
+  base = 0;
+  e = 0;
+  for(i = 0; i < NEXTENT && ip->ext[i].len > 0; i++){
+    e = &ip->ext[i];
+    if(bn < base + e->len)
+      return e->start + (bn - base);
+    base += e->len;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  if(bn == base && ip->indirect == 0 && ip->dindirect == 0){
+    // Appending, and the extents are still in use: grow the
+    // last extent if the next disk block is free, otherwise
+    // start a new extent if there is a free slot.
+    if(e && (addr = ballocat(ip->dev, e->start + e->len)) != 0){
+      e->len++;
+      return addr;
     }
-    brelse(bp);
-    return addr;
+    if(i < NEXTENT){
+      ip->ext[i].start = addr = balloc(ip->dev, e ? e->start + e->len : 0);
+      ip->ext[i].len = 1;
+      return addr;
+    }
+  }
+  bn -= base;
+  goal = e ? e->start + e->len : 0;
+
+  if(bn < NINDIRECT)
+    return indirect(ip, &ip->indirect, bn, goal);
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    addr = indirect(ip, &ip->dindirect, bn / NINDIRECT, goal);
+    return indirect(ip, &addr, bn % NINDIRECT, addr + 1);
   }
 
   panic("bmap: out of range");
 }
 
+// Return a locked buf holding the block of ip that
+// contains byte off, allocating the block if there is none.
+// Lets callers such as splice move data between the buffer
+// cache and somewhere other than a user or kernel address.
+// Caller must hold ip->lock, and be inside a transaction
+// if the block might need to be allocated.
+struct buf*
+ibread(struct inode *ip, uint off)
+{
+  return bread(ip->dev, bmap(ip, off/BSIZE));
+}
+
+// Free the blocks listed in indirect block addr, and addr.
+static void
+ifree(uint dev, uint addr)
+{
+  int j;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -413,23 +868,35 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  pcdrop(ip->dev, ip->inum);
+
+  for(i = 0; i < NEXTENT; i++){
+    for(j = 0; j < ip->ext[i].len; j++)
+      bfree(ip->dev, ip->ext[i].start + j);
+    ip->ext[i].start = 0;
+    ip->ext[i].len = 0;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  if(ip->indirect){
+    ifree(ip->dev, ip->indirect);
+    ip->indirect = 0;
+  }
+
+  if(ip->dindirect){
+    bp = bread(ip->dev, ip->dindirect);
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        ifree(ip->dev, a[j]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->dindirect);
+    ip->dindirect = 0;
+  }
+
+  if(ip->dindex){
+    bfree(ip->dev, ip->dindex);
+    ip->dindex = 0;
   }
 
   ip->size = 0;
@@ -448,31 +915,240 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Sequential readahead.
+// A read that starts in the block where the previous read
+// of ip ended is sequential, and doubles the readahead window,
+// up to NREADAHEAD blocks; any other read closes it. The
+// blocks of the read itself plus the window beyond it are
+// started without waiting, so that they go to the disk as
+// one merged request and later reads find them in the cache.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint addrs[2*NREADAHEAD];
+  uint bn, end, nb;
+  int i, na;
+
+  bn = off / BSIZE;
+  if(bn != ip->ranext){
+    ip->rawin = 0;
+    ip->raend = 0;
+    return;
+  }
+  ip->rawin = ip->rawin ? min(2*ip->rawin, NREADAHEAD) : 2;
+
+  end = (off + n + BSIZE - 1) / BSIZE + ip->rawin;
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  if(end > nb)
+    end = nb;
+  if(bn < ip->raend)
+    bn = ip->raend;
+  if(end > bn + 2*NREADAHEAD)
+    end = bn + 2*NREADAHEAD;
+  if(bn >= end)
+    return;
+
+  // look up all the addresses first: bmap() may have to read
+  // an indirect block, which would send the reads early.
+  na = 0;
+  for(; bn < end; bn++)
+    addrs[na++] = bmap(ip, bn);
+  for(i = 0; i < na; i++)
+    breadahead(ip->dev, addrs[i]);
+  bsubmit();
+  ip->raend = end;
+}
+
+// Fill page cache page pg, just allocated for regular file
+// ip, from disk, for a read of n bytes at off. Like
+// readahead(), a sequential read also fills the pages after
+// the ones it wants, doubling the window up to NPGREAD-1
+// pages. File data goes from the disk straight into the
+// pages, not through the buffer cache, and all the reads are
+// started before waiting for any.
+// Caller must hold ip->lock.
+static void
+ireadpages(struct inode *ip, struct cpage *pg, uint off, uint n)
+{
+  struct cpage *pgs[NPGREAD], *p;
+  struct buf one, *b;
+  uint pgno, end, o, oend;
+  int i, nb, maxb, npg;
+
+  if(off / BSIZE == ip->ranext)
+    ip->rawin = ip->rawin ? min(2*ip->rawin, NPGREAD-1) : 1;
+  else
+    ip->rawin = 0;
+
+  // headers for the disk requests; without a page for them,
+  // read just pg, a block at a time.
+  if((b = (struct buf*)kalloc()) != 0){
+    maxb = PGSIZE / sizeof(struct buf);
+    end = (off + n + PGSIZE - 1) / PGSIZE + ip->rawin;
+  } else {
+    b = &one;
+    maxb = 1;
+    end = pg->pgno + 1;
+  }
+  end = min(end, (ip->size + PGSIZE - 1) / PGSIZE);
+  end = min(end, pg->pgno + NPGREAD);
+
+  pgs[0] = pg;
+  npg = 1;
+  for(pgno = pg->pgno + 1; pgno < end; pgno++){
+    if((p = pclookup(ip->dev, ip->inum, pgno)) != 0){
+      pcput(p);
+      continue;
+    }
+    if((p = pcalloc(ip->dev, ip->inum, pgno)) == 0)
+      break;
+    pgs[npg++] = p;
+  }
+
+  nb = 0;
+  for(i = 0; i < npg; i++){
+    oend = min(ip->size, (pgs[i]->pgno + 1) * PGSIZE);
+    for(o = pgs[i]->pgno * PGSIZE; o < oend; o += BSIZE){
+      if(nb == maxb){
+        breadraw(ip->dev, b, nb);
+        nb = 0;
+      }
+      b[nb].blockno = bmap(ip, o / BSIZE);
+      b[nb].data = (uchar*)pgs[i]->data + o % PGSIZE;
+      nb++;
+    }
+  }
+  breadraw(ip->dev, b, nb);
+
+  for(i = 0; i < npg; i++){
+    // zero what's past the end of the file.
+    o = pgs[i]->pgno * PGSIZE;
+    oend = ip->size > o ? ip->size - o : 0;
+    if(oend < PGSIZE)
+      memset(pgs[i]->data + oend, 0, PGSIZE - oend);
+    __sync_synchronize();
+    pgs[i]->valid = 1;  // for ipagepeek()
+    if(i > 0)
+      pcput(pgs[i]);
+  }
+  if(b != &one)
+    kfree((char*)b);
+}
+
+// Return the page cache page holding page pgno of regular
+// file ip, with a reference taken, reading it from disk if
+// need be, along with readahead for a read of n bytes at
+// off. Returns 0 if there's no memory for it.
+// Caller must hold ip->lock.
+struct cpage*
+ipage(struct inode *ip, uint pgno, uint off, uint n)
+{
+  struct cpage *pg;
+
+  if((pg = pclookup(ip->dev, ip->inum, pgno)) != 0)
+    return pg;
+  if((pg = pcalloc(ip->dev, ip->inum, pgno)) == 0)
+    return 0;
+  ireadpages(ip, pg, off, n);
+  return pg;
+}
+
+// Return page pgno of regular file ip from the page cache,
+// with a reference to the memory (see kref()) for a page
+// table to map it with. Returns 0 if there's no memory for it.
+// Caller must hold ip->lock.
+void*
+ipagemap(struct inode *ip, uint pgno)
+{
+  struct cpage *pg;
+  char *pa;
+
+  if((pg = ipage(ip, pgno, pgno * PGSIZE, PGSIZE)) == 0)
+    return 0;
+  pa = pg->data;
+  kref(pa);
+  pcput(pg);
+  return pa;
+}
+
+// Like ipagemap(), but only if the page is cached already,
+// so it never sleeps, and the caller needn't hold ip->lock.
+void*
+ipagepeek(struct inode *ip, uint pgno)
+{
+  struct cpage *pg;
+  char *pa;
+
+  if((pg = pclookup(ip->dev, ip->inum, pgno)) == 0)
+    return 0;
+  pa = 0;
+  if(pg->valid){  // not still being read by ireadpages()
+    pa = pg->data;
+    kref(pa);
+  }
+  pcput(pg);
+  return pa;
+}
+
+// Copy m bytes at off of ip to dst through the buffer cache.
+// Returns 0, or -1 if the copy fails.
+static int
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint m)
+{
+  struct buf *bp;
+  uint tot, m1;
+
+  for(tot = 0; tot < m; tot += m1, off += m1, dst += m1){
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    m1 = min(m - tot, BSIZE - off%BSIZE);
+    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m1) == -1) {
+      brelse(bp);
+      return -1;
+    }
+    brelse(bp);
+  }
+  return 0;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Regular files are read through the page cache, and
+// everything else through the buffer cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  struct cpage *pg;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(ip->type != T_FILE)
+    readahead(ip, off, n);
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if(ip->type == T_FILE && (pg = ipage(ip, off/PGSIZE, off, n - tot)) != 0){
+      r = either_copyout(user_dst, dst, pg->data + (off % PGSIZE), m);
+      pcput(pg);
+    } else {
+      // not a regular file, or no memory to cache the page,
+      // in which case nothing maps it either, so the buffer
+      // cache has the file's latest data.
+      r = readblocks(ip, user_dst, dst, off, m);
+    }
+    if(r == -1){
       tot = -1;
       break;
     }
-    brelse(bp);
   }
+  ip->ranext = off / BSIZE;
   return tot;
 }
 
@@ -502,6 +1178,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       break;
     }
     log_write(bp);
+    if(ip->type == T_FILE)
+      pcupdate(ip->dev, ip->inum, off, bp->data + (off % BSIZE), m);
     brelse(bp);
   }
 
@@ -509,8 +1187,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     ip->size = off;
 
   // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // because the loop above might have called bmap() and changed
+  // ip->ext[] or ip->indirect.
   iupdate(ip);
 
   return tot;
@@ -524,32 +1202,319 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name cache.
+//
+// dirlookup() remembers what it found, an entry or the lack
+// of one, keyed by (dev, directory inum, name), so that the
+// next lookup of the name needn't read and scan the directory.
+// Lookups and changes of a directory's entries are all made
+// with the directory locked, and every change updates the
+// cache (dirlink(), dcforget(), and iput() of a freed
+// directory), so cached names are never stale.
+// The cache is set-associative: a name can only be in one of
+// the DCWAYS slots of its bucket, and replaces the least
+// recently used one.
+
+#define NDCBUCKET 64
+#define DCWAYS 4
+
+struct dentry {
+  uint dev;
+  uint dinum;          // directory inode; 0 if slot unused
+  char name[DIRSIZ];
+  uint inum;           // 0 if name is not in the directory
+  uint off;            // offset of the dirent if it is
+  uint lastuse;
+};
+
+struct dcbucket {
+  struct spinlock lock;
+  struct dentry e[DCWAYS];
+};
+
+struct {
+  struct dcbucket bucket[NDCBUCKET];
+  uint clock;          // source of lastuse stamps
+  // counters, updated atomically.
+  uint nhit;           // lookups answered by an entry
+  uint nneg;           // ... by the lack of one
+  uint nmiss;          // lookups that scanned the directory
+  uint nforget;        // entries removed by unlink
+} dcache;
+
+void
+dcinit(void)
+{
+  int i;
+
+  for(i = 0; i < NDCBUCKET; i++)
+    initlock(&dcache.bucket[i].lock, "dcache");
+}
+
+static struct dcbucket*
+dchash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.bucket[h % NDCBUCKET];
+}
+
+// Find the slot for name in dp in bucket bk.
+// Caller must hold bk->lock.
+static struct dentry*
+dcfind(struct dcbucket *bk, struct inode *dp, char *name)
+{
+  struct dentry *e;
+
+  for(e = bk->e; e < bk->e + DCWAYS; e++){
+    if(e->dinum == dp->inum && e->dev == dp->dev &&
+       namecmp(e->name, name) == 0)
+      return e;
+  }
+  return 0;
+}
+
+// If the cache knows about name in dp, set *inum (0 if
+// there is no such entry) and *off, and return 1.
+// Caller must hold dp->lock.
+static int
+dclookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dcbucket *bk;
+  struct dentry *e;
+
+  bk = dchash(dp->dev, dp->inum, name);
+  acquire(&bk->lock);
+  if((e = dcfind(bk, dp, name)) == 0){
+    release(&bk->lock);
+    __sync_fetch_and_add(&dcache.nmiss, 1);
+    return 0;
+  }
+  e->lastuse = __sync_fetch_and_add(&dcache.clock, 1);
+  *inum = e->inum;
+  *off = e->off;
+  release(&bk->lock);
+  __sync_fetch_and_add(*inum ? &dcache.nhit : &dcache.nneg, 1);
+  return 1;
+}
+
+// Remember that name in dp is inode inum (or is absent, if
+// inum is 0) with its dirent at off.
+// Caller must hold dp->lock.
+static void
+dcput(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dcbucket *bk;
+  struct dentry *e, *victim;
+
+  bk = dchash(dp->dev, dp->inum, name);
+  acquire(&bk->lock);
+  if((victim = dcfind(bk, dp, name)) == 0){
+    victim = bk->e;
+    for(e = bk->e; e < bk->e + DCWAYS; e++){
+      if(e->dinum == 0){
+        victim = e;
+        break;
+      }
+      if(e->lastuse < victim->lastuse)
+        victim = e;
+    }
+  }
+  victim->dev = dp->dev;
+  victim->dinum = dp->inum;
+  strncpy(victim->name, name, DIRSIZ);
+  victim->inum = inum;
+  victim->off = off;
+  victim->lastuse = __sync_fetch_and_add(&dcache.clock, 1);
+  release(&bk->lock);
+}
+
+// Forget about name in dp, whose dirent has been cleared.
+// Caller must hold dp->lock.
+void
+dcforget(struct inode *dp, char *name)
+{
+  struct dcbucket *bk;
+  struct dentry *e;
+
+  bk = dchash(dp->dev, dp->inum, name);
+  acquire(&bk->lock);
+  if((e = dcfind(bk, dp, name)) != 0){
+    e->dinum = 0;
+    __sync_fetch_and_add(&dcache.nforget, 1);
+  }
+  release(&bk->lock);
+}
+
+// Forget all names in directory dp, which is being freed,
+// so that a directory that reuses its inode starts afresh.
+static void
+dcpurge(struct inode *dp)
+{
+  struct dcbucket *bk;
+  struct dentry *e;
+
+  for(bk = dcache.bucket; bk < dcache.bucket + NDCBUCKET; bk++){
+    acquire(&bk->lock);
+    for(e = bk->e; e < bk->e + DCWAYS; e++){
+      if(e->dinum == dp->inum && e->dev == dp->dev)
+        e->dinum = 0;
+    }
+    release(&bk->lock);
+  }
+}
+
+// Directory index (see fs.h).
+//
+// Looking a name up reads the first block, the index block,
+// and the blocks of the name's bucket, however big the
+// directory is. Entries never move once written, so offsets
+// handed out by dirlookup() stay good.
+
+// Which bucket name belongs in.
+// mkfs has a copy of this; the two must agree.
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDIRHASH;
+}
+
+// Look for name in the directory block that starts at off.
+// Returns the entry's offset and sets *inum if found.
+// Otherwise returns -1, after setting *free to the offset
+// of a free slot if *free is -1 and there is one. If the
+// block is a hashed one, sets *next to the next block in
+// its bucket.
+static int
+dirscan(struct inode *dp, uint off, char *name, uint *inum, int *free, uint *next)
+{
+  struct buf *bp;
+  struct dirent *de;
+  int i, n, r;
+
+  bp = ibread(dp, off);
+  de = (struct dirent*)bp->data;
+  if(off == 0){
+    i = 0;
+    n = min(dp->size, BSIZE) / sizeof(*de);
+  } else {
+    i = 1;  // skip the header
+    n = DPB;
+    memmove(next, de[0].name, sizeof(*next));
+  }
+  r = -1;
+  for(; i < n; i++){
+    if(de[i].inum == 0){
+      if(free && *free < 0)
+        *free = off + i*sizeof(*de);
+      continue;
+    }
+    if(namecmp(name, de[i].name) == 0){
+      *inum = de[i].inum;
+      r = off + i*sizeof(*de);
+      break;
+    }
+  }
+  brelse(bp);
+  return r;
+}
+
+// Look for name in the first block of dp and then in the
+// blocks of its bucket. Returns its offset, or -1; see
+// dirscan() for inum and free.
+static int
+dirfind(struct inode *dp, char *name, uint *inum, int *free)
+{
+  struct buf *bp;
+  uint fbn, next;
+  int off;
+
+  if(dp->size == 0)
+    return -1;
+  if((off = dirscan(dp, 0, name, inum, free, &next)) >= 0)
+    return off;
+  if(dp->dindex == 0)
+    return -1;
+
+  bp = bread(dp->dev, dp->dindex);
+  fbn = ((uint*)bp->data)[dirhash(name)];
+  brelse(bp);
+  for(; fbn != 0; fbn = next){
+    if((off = dirscan(dp, fbn*BSIZE, name, inum, free, &next)) >= 0)
+      return off;
+  }
+  return -1;
+}
+
+// Add a block holding de to the front of the bucket of
+// de's name, creating the index if need be.
+// Returns de's offset.
+static int
+dirgrow(struct inode *dp, struct dirent *de)
+{
+  struct buf *bp, *ibp;
+  struct dirent *d;
+  uint fbn, *index;
+  int h;
+
+  if(dp->dindex == 0)
+    dp->dindex = balloc(dp->dev, 0);
+  h = dirhash(de->name);
+  fbn = dp->size / BSIZE;  // whole blocks, once the first is full
+  bp = ibread(dp, fbn*BSIZE);
+  ibp = bread(dp->dev, dp->dindex);
+  index = (uint*)ibp->data;
+  d = (struct dirent*)bp->data;
+  memmove(d[0].name, &index[h], sizeof(index[h]));
+  d[1] = *de;
+  log_write(bp);
+  index[h] = fbn;
+  log_write(ibp);
+  brelse(ibp);
+  brelse(bp);
+  dp->size = (fbn + 1) * BSIZE;
+  iupdate(dp);
+  return fbn*BSIZE + sizeof(*de);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint inum, coff;
+  int off;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if(dclookup(dp, name, &inum, &coff)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = coff;
+    return iget(dp->dev, inum);
   }
 
-  return 0;
+  if((off = dirfind(dp, name, &inum, 0)) < 0){
+    dcput(dp, name, 0, 0);
+    return 0;
+  }
+  // entry matches path element
+  if(poff)
+    *poff = off;
+  dcput(dp, name, inum, off);
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -557,27 +1522,24 @@ int
 dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
+  uint x;
   struct dirent de;
-  struct inode *ip;
 
-  // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  // Check that name is not present, and look for an
+  // empty dirent on the way.
+  off = -1;
+  if(dirfind(dp, name, &x, &off) >= 0)
     return -1;
-  }
-
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
-  }
+  if(off < 0 && dp->size < BSIZE)
+    off = dp->size;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+  if(off < 0){
+    off = dirgrow(dp, &de);
+  } else if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcput(dp, name, inum, off);
 
   return 0;
 }
@@ -672,3 +1634,29 @@ nameiparent(char *path, char *name)
 {
   return namex(path, 1, name);
 }
+
+// Format block and inode allocator and name cache counters
+// for the statistics device.
+int
+fsstats(char *buf, int sz)
+{
+  int n, i;
+  uint nfree;
+
+  acquire(&bsum.lock);
+  nfree = 0;
+  for(i = 0; i < NBITMAP; i++)
+    nfree += bsum.nfree[i];
+  n = snprintf(buf, sz, "--- balloc\nalloc %d at goal %d bitmap reads %d free %d\n",
+               bsum.nalloc, bsum.ngoal, bsum.nread, nfree);
+  release(&bsum.lock);
+  n += snprint_lock(buf+n, sz-n, &bsum.lock);
+  n += snprintf(buf+n, sz-n, "--- ialloc\nalloc %d inode map reads %d\n",
+                imap.nalloc, imap.nread);
+  n += snprintf(buf+n, sz-n, "--- itable\nhit %d miss %d entries %d\n",
+                itable.nhit, itable.nmiss, itable.ninode);
+  n += snprint_lock(buf+n, sz-n, &itable.lock);
+  n += snprintf(buf+n, sz-n, "--- dcache\nhit %d negative %d miss %d forget %d\n",
+                dcache.nhit, dcache.nneg, dcache.nmiss, dcache.nforget);
+  return n;
+}
@@ -7,7 +7,7 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                          inode bit map | free bit map | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -20,13 +20,21 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint imapstart;    // Block number of first inode map block
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+#define NEXTENT 5
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NINDIRECT + NDINDIRECT)  // at least; extents add more
+
+// A run of consecutive data blocks.
+struct extent {
+  uint start;           // First block
+  uint len;             // Number of blocks
+};
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +43,10 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT]; // The file's first blocks, in order
+  uint indirect;        // Block of addresses of the blocks after those
+  uint dindirect;       // Block of addresses of more indirect blocks
+  uint dindex;          // Directory hash index block (T_DIR only)
 };
 
 // Inodes per block.
@@ -50,6 +61,9 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Block of inode map containing bit for inode i
+#define IMBLOCK(i, sb) ((i)/BPB + sb.imapstart)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -58,3 +72,17 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A directory's first block holds entries in no particular
+// order. Once it is full, the directory gets an index block
+// (dindex) of NDIRHASH file block numbers, and each later
+// block holds only names that hash to one of those buckets.
+// Such a block starts with a header dirent, with inum 0 so
+// that readers skip it, whose name holds the file block
+// number of the next block in the bucket, or 0. A bucket's
+// first block only fills after some 4000 names, but each
+// bucket in use costs a block.
+#define NDIRHASH      64
+
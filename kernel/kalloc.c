@@ -1,6 +1,33 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order of them.
+//
+// Each CPU has its own free list, so kalloc() and kfree()
+// normally take only a lock that no other CPU wants.
+// Pages move between the per-CPU lists and a shared pool
+// (kmem) in batches of KBATCH: an empty CPU list is refilled
+// from the pool, and a CPU list that grows past KHIWAT hands
+// a batch back. If the pool is empty too, kalloc() steals
+// half of some other CPU's list.
+//
+// The pool is a buddy allocator. A free block of 2^k pages
+// starts a multiple of 2^k pages from KERNBASE, and its buddy
+// is the other half of the block of 2^(k+1) pages they make up.
+// Allocation splits the smallest block that is big enough, and
+// a block given back is merged with its buddy for as long as
+// the buddy is free too, so the pool stays in big blocks that
+// kallocorder() can hand out whole.
+//
+// A page can be mapped by several page tables at once (see
+// copy-on-write fork in vm.c), so each page has a reference
+// count. kalloc() sets it to one, kref() adds a reference,
+// and kfree() only frees the page when the last one is dropped.
+//
+// The pages of a block from kallocorder() are ordinary pages
+// with their own reference counts, so that, for example, a
+// superpage (see vm.c) can be split and its pages freed one
+// at a time.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +36,10 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH   32           // pages moved per refill or flush
+#define MAXORDER 10           // biggest pool block is 2^MAXORDER pages
+#define KHIWAT   (4*KBATCH)   // flush a batch above this many
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,17 +47,57 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // only used in the pool
 };
 
+// the shared pool.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[MAXORDER+1];  // free blocks of each order,
+                                // circular through next/prev.
+  int nblock[MAXORDER+1];       // ... and how many there are
+  int nfree;                    // pages in all of them
+  uint nsplit;   // blocks split in two
+  uint nmerge;   // blocks merged with their buddy
+  uint nbig;     // blocks of more than a page handed out
+  uint nfail;    // kallocorder() calls with no block big enough
 } kmem;
 
+// per-CPU free lists.
+// everything is protected by lock, including the counters.
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint nalloc;   // pages handed out by kalloc()
+  uint nrefill;  // batches taken from the pool
+  uint nflush;   // batches given back to the pool
+  uint nsteal;   // batches stolen from another CPU
+} kcpu[NCPU];
+
+// per-page reference counts, indexed by PA2REF().
+// updated with atomic instructions rather than a lock.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+int pageref[PA2REF(PHYSTOP)];
+
+// for each page, one more than the order of the free block
+// in the pool that starts there, or 0.
+uchar blockorder[PA2REF(PHYSTOP)];
+
+static void buddyfree(struct run*, int);
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem");
+  for(i = 0; i <= MAXORDER; i++){
+    kmem.free[i].next = &kmem.free[i];
+    kmem.free[i].prev = &kmem.free[i];
+  }
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,48 +106,406 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&kmem.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    memset(p, 1, PGSIZE);
+    buddyfree((struct run*)p, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Put the free block of 2^order pages at r on its list.
+// Caller must hold kmem.lock.
+static void
+buddypush(struct run *r, int order)
+{
+  r->next = kmem.free[order].next;
+  r->prev = &kmem.free[order];
+  r->next->prev = r;
+  kmem.free[order].next = r;
+  blockorder[PA2REF(r)] = order + 1;
+  kmem.nblock[order]++;
+}
+
+// Take the free block at r off its list.
+// Caller must hold kmem.lock.
+static void
+buddyunlink(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nblock[blockorder[PA2REF(r)] - 1]--;
+  blockorder[PA2REF(r)] = 0;
+}
+
+// Take a block of 2^order pages from the pool, splitting
+// the smallest bigger one if there's none that size.
+// Returns 0 if there's no block big enough.
+// Caller must hold kmem.lock.
+static struct run*
+buddyalloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++){
+    if(kmem.free[k].next != &kmem.free[k])
+      break;
+  }
+  if(k > MAXORDER)
+    return 0;
+  r = kmem.free[k].next;
+  buddyunlink(r);
+  while(k > order){
+    // keep the first half, and free the second.
+    k--;
+    buddypush((struct run*)((char*)r + ((uint64)PGSIZE << k)), k);
+    kmem.nsplit++;
+  }
+  kmem.nfree -= 1 << order;
+  return r;
+}
+
+// Give the block of 2^order pages at r back to the pool,
+// merging it with its buddy for as long as that is free.
+// Caller must hold kmem.lock.
+static void
+buddyfree(struct run *r, int order)
+{
+  uint64 off, b;
+
+  kmem.nfree += 1 << order;
+  off = (uint64)r - KERNBASE;
+  while(order < MAXORDER){
+    b = KERNBASE + (off ^ ((uint64)PGSIZE << order));
+    if(b >= PHYSTOP || blockorder[PA2REF(b)] != order + 1)
+      break;
+    buddyunlink((struct run*)b);
+    off &= ~((uint64)PGSIZE << order);
+    order++;
+    kmem.nmerge++;
+  }
+  buddypush((struct run*)(KERNBASE + off), order);
+}
+
+// Unlink up to n pages from the front of *fl.
+// Returns the unlinked chain and sets *got to its length.
+// Caller must hold the lock protecting *fl.
+static struct run*
+detach(struct run **fl, int n, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *fl;
+  r = 0;
+  for(i = 0; i < n && *fl; i++){
+    r = *fl;
+    *fl = r->next;
+  }
+  if(r)
+    r->next = 0;
+  *got = i;
+  return i > 0 ? head : 0;
+}
+
+// Push the chain of pages starting at r onto *fl.
+// Caller must hold the lock protecting *fl.
+static void
+attach(struct run **fl, struct run *r)
+{
+  struct run *next;
+
+  for(; r; r = next){
+    next = r->next;
+    r->next = *fl;
+    *fl = r;
+  }
+}
+
+// Give CPU id a batch of pages, from the pool if it has
+// any, otherwise from another CPU.
+// Called with interrupts off and no kmem locks held,
+// so that we never hold two free-list locks at once.
+static void
+refill(int id)
+{
+  struct run *chain, *r;
+  int i, n, stolen;
+
+  // single pages from the smallest blocks, which leaves
+  // the big ones whole.
+  acquire(&kmem.lock);
+  chain = 0;
+  for(n = 0; n < KBATCH && (r = buddyalloc(0)) != 0; n++){
+    r->next = chain;
+    chain = r;
+  }
+  release(&kmem.lock);
+
+  stolen = 0;
+  for(i = 1; i < NCPU && n == 0; i++){
+    int v = (id + i) % NCPU;
+    acquire(&kcpu[v].lock);
+    chain = detach(&kcpu[v].freelist, (kcpu[v].nfree + 1) / 2, &n);
+    kcpu[v].nfree -= n;
+    release(&kcpu[v].lock);
+    stolen = 1;
+  }
+
+  if(n == 0)
+    return;
+
+  acquire(&kcpu[id].lock);
+  attach(&kcpu[id].freelist, chain);
+  kcpu[id].nfree += n;
+  if(stolen)
+    kcpu[id].nsteal++;
+  else
+    kcpu[id].nrefill++;
+  release(&kcpu[id].lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Add a reference to a page returned by kalloc().
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&pageref[PA2REF(pa)], 1) < 1)
+    panic("kref: free page");
+}
+
+// Return the number of references to page pa.
+int
+krefcnt(void *pa)
+{
+  return pageref[PA2REF(pa)];
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator;
+// see kinit above.)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain, *next;
+  int id, n, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&pageref[PA2REF(pa)], 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+
+  acquire(&kcpu[id].lock);
+  r->next = kcpu[id].freelist;
+  kcpu[id].freelist = r;
+  kcpu[id].nfree++;
+  chain = 0;
+  if(kcpu[id].nfree > KHIWAT){
+    chain = detach(&kcpu[id].freelist, KBATCH, &n);
+    kcpu[id].nfree -= n;
+    kcpu[id].nflush++;
+  }
+  release(&kcpu[id].lock);
+
+  if(chain){
+    acquire(&kmem.lock);
+    for(; chain; chain = next){
+      next = chain->next;
+      buddyfree(chain, 0);
+    }
+    release(&kmem.lock);
+  }
+
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
+// Returns 0 if the memory cannot be allocated, even after
+// taking pages back from the page cache.
 void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+
+  acquire(&kcpu[id].lock);
+  if(kcpu[id].freelist == 0){
+    release(&kcpu[id].lock);
+    refill(id);
+    acquire(&kcpu[id].lock);
+  }
+  r = kcpu[id].freelist;
+  if(r){
+    kcpu[id].freelist = r->next;
+    kcpu[id].nfree--;
+    kcpu[id].nalloc++;
+  }
+  release(&kcpu[id].lock);
+
+  pop_off();
+
+  if(r == 0 && pcreclaim())  // out of memory; shrink the page cache
+    return kalloc();
+
+  if(r){
+    pageref[PA2REF(r)] = 1;
+    memset((char*)r, 5, PGSIZE); // fill with junk
+  }
+  return (void*)r;
+}
+
+// Give every CPU's free pages back to the pool, where they
+// may complete bigger blocks.
+static void
+drain(void)
+{
+  struct run *chain, *next;
+  int i, n;
+
+  for(i = 0; i < NCPU; i++){
+    acquire(&kcpu[i].lock);
+    chain = detach(&kcpu[i].freelist, kcpu[i].nfree, &n);
+    kcpu[i].nfree -= n;
+    release(&kcpu[i].lock);
+
+    acquire(&kmem.lock);
+    for(; chain; chain = next){
+      next = chain->next;
+      buddyfree(chain, 0);
+    }
+    release(&kmem.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Each page gets a reference count of one, as if
+// from kalloc(), and can be freed on its own with kfree(), or
+// all of them together with kfreeorder().
+// Returns 0 if there's no free block that big, even after
+// taking back the CPUs' free pages.
+void *
+kallocorder(int order)
+{
+  struct run *r;
+  int i;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
+  if((r = buddyalloc(order)) == 0){
+    release(&kmem.lock);
+    drain();
+    acquire(&kmem.lock);
+    r = buddyalloc(order);
+  }
   if(r)
-    kmem.freelist = r->next;
+    kmem.nbig++;
+  else
+    kmem.nfail++;
   release(&kmem.lock);
+  if(r == 0)
+    return 0;
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  for(i = 0; i < (1 << order); i++)
+    pageref[PA2REF(r) + i] = 1;
+  memset((char*)r, 5, (uint64)PGSIZE << order); // fill with junk
   return (void*)r;
 }
+
+// Drop a reference to each of the 2^order pages at pa, which
+// came from kallocorder(), and give back those that are now
+// free: as a single block if all of them are.
+void
+kfreeorder(void *pa, int order)
+{
+  uchar last[(1 << MAXORDER) / 8];
+  int i, n, nlast, ref;
+
+  if(order < 0 || order > MAXORDER || (char*)pa < end || (uint64)pa >= PHYSTOP ||
+     ((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0)
+    panic("kfreeorder");
+
+  n = 1 << order;
+  nlast = 0;
+  memset(last, 0, sizeof(last));
+  for(i = 0; i < n; i++){
+    ref = __sync_sub_and_fetch(&pageref[PA2REF(pa) + i], 1);
+    if(ref < 0)
+      panic("kfreeorder: ref");
+    if(ref == 0){
+      // Fill with junk to catch dangling refs.
+      memset((char*)pa + i*PGSIZE, 1, PGSIZE);
+      last[i/8] |= 1 << (i%8);
+      nlast++;
+    }
+  }
+  if(nlast == 0)
+    return;
+
+  acquire(&kmem.lock);
+  if(nlast == n){
+    buddyfree((struct run*)pa, order);
+  } else {
+    for(i = 0; i < n; i++){
+      if(last[i/8] & (1 << (i%8)))
+        buddyfree((struct run*)((char*)pa + i*PGSIZE), 0);
+    }
+  }
+  release(&kmem.lock);
+}
+
+// Format allocator counters for the statistics device.
+int
+kallocstats(char *buf, int sz)
+{
+  int i, n, big;
+
+  n = snprintf(buf, sz, "--- kalloc\npool: free %d split %d merge %d big %d fail %d\n",
+               kmem.nfree, kmem.nsplit, kmem.nmerge, kmem.nbig, kmem.nfail);
+
+  // free blocks of each order, and how much of the free memory
+  // is in blocks too small for a superpage.
+  n += snprintf(buf+n, sz-n, "blocks");
+  big = 0;
+  for(i = 0; i <= MAXORDER; i++){
+    n += snprintf(buf+n, sz-n, " %d", kmem.nblock[i]);
+    if(i >= SUPERPGORDER)
+      big += kmem.nblock[i] << i;
+  }
+  n += snprintf(buf+n, sz-n, "\nunusable for superpage %d%%\n",
+                kmem.nfree ? (kmem.nfree - big) * 100 / kmem.nfree : 0);
+  n += snprint_lock(buf+n, sz-n, &kmem.lock);
+  for(i = 0; i < NCPU; i++){
+    if(kcpu[i].lock.n == 0)
+      continue;
+    n += snprintf(buf+n, sz-n,
+                  "cpu%d: free %d alloc %d refill %d flush %d steal %d\n",
+                  i, kcpu[i].nfree, kcpu[i].nalloc, kcpu[i].nrefill,
+                  kcpu[i].nflush, kcpu[i].nsteal);
+    n += snprint_lock(buf+n, sz-n, &kcpu[i].lock);
+  }
+  return n;
+}
@@ -21,13 +21,32 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
-// The log is a physical re-do log containing disk blocks.
+// The log is double-buffered. System calls always join the
+// open transaction, while the previous one may still be
+// being written to the log and installed. When the last
+// outstanding end_op() finds the open transaction ready
+// (see ready()), it copies the transaction's blocks into
+// logbuf[], which takes a moment, and then lets new system
+// calls start a fresh transaction while it does the disk
+// writes from that copy. Only one transaction is written at
+// a time; while it is, the open one keeps absorbing system
+// calls, so a busy log commits them in large groups.
+//
+// Committing a transaction only appends its blocks to the
+// log and rewrites the header; the blocks stay pinned in the
+// buffer cache and are not written to their home locations
+// until the log fills up and a begin_op() that needs the
+// space checkpoints it (see checkpoint()). A block that is
+// written by many transactions in between, such as a bitmap
+// or inode block, is installed only once.
+//
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
+// A block can appear more than once; the last copy wins.
 // Log appends are synchronous.
 
 // Contents of the header block, used for both the on-disk header block
@@ -42,12 +61,38 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int copying;     // copying the closed transaction, please wait.
+  int committing;  // in commit() or checkpoint(), don't start another.
+  uint opened;     // ticks when lh got its first block.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction.
+  struct logheader clh; // the one being committed.
+  struct logheader dlh; // committed to the log, but not installed.
+  uint ncommit;    // transactions committed
+  uint nblock;     // blocks in those transactions
+  uint nop;        // system calls in those transactions
+  int ops;         // system calls in the open transaction
+  uint ncheckpoint; // checkpoints
+  uint ninstall;   // blocks written home by checkpoints
 };
 struct log log;
 
+// private copies of the blocks in the on-disk log, one per
+// log block, so that they can be installed without reading
+// them back; not part of the buffer cache.
+struct buf logbuf[LOGSIZE];
+static uchar logdata[LOGSIZE][BSIZE];
+
+// number of blocks the log may hold: what the on-disk log
+// has room for, but no more than leaves MAXOPBLOCKS buffers
+// unpinned, since every logged block stays pinned in the
+// buffer cache until it is installed.
+#define LOGSLOTS (log.size - 1 < NBUF - MAXOPBLOCKS ? \
+                  log.size - 1 : NBUF - MAXOPBLOCKS)
+
+// log blocks in use or spoken for.
+#define LOGUSED (log.dlh.n + log.clh.n + log.lh.n)
+
 static void recover_from_log(void);
 static void commit();
 
@@ -58,27 +103,48 @@ initlog(int dev, struct superblock *sb)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
+  for (int i = 0; i < LOGSIZE; i++) {
+    initsleeplock(&logbuf[i].lock, "logbuf");
+    logbuf[i].data = logdata[i];
+  }
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  if (LOGSLOTS < MAXOPBLOCKS)
+    panic("initlog: log or buffer cache too small");
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy the committed blocks in logbuf[0..log.dlh.n) to their
+// home locations. Only the last copy of a block that appears
+// more than once is written. Starts all the writes before
+// waiting for any, so that the disk driver can merge
+// adjacent blocks.
 static void
-install_trans(int recovering)
+install_trans(void)
 {
-  int tail;
+  int tail, i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < log.dlh.n; tail++) {
+    struct buf *b = &logbuf[tail];
+    for (i = tail+1; i < log.dlh.n; i++)
+      if (log.dlh.block[i] == log.dlh.block[tail])
+        break;
+    if (i < log.dlh.n) {  // a later copy will be installed
+      b->blockno = 0;
+      continue;
+    }
+    acquiresleep(&b->lock);
+    b->dev = log.dev;
+    b->blockno = log.dlh.block[tail];
+    bawrite(b);
+    log.ninstall++;
+  }
+  for (tail = 0; tail < log.dlh.n; tail++) {
+    if (logbuf[tail].blockno == 0)
+      continue;
+    bwait(&logbuf[tail]);
+    releasesleep(&logbuf[tail].lock);
   }
 }
 
@@ -89,9 +155,9 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.dlh.n = lh->n;
+  for (i = 0; i < log.dlh.n; i++) {
+    log.dlh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -105,9 +171,9 @@ write_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.dlh.n;
+  for (i = 0; i < log.dlh.n; i++) {
+    hb->block[i] = log.dlh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -116,95 +182,200 @@ write_head(void)
 static void
 recover_from_log(void)
 {
+  int tail;
+
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  // if committed, copy from log to disk
+  for (tail = 0; tail < log.dlh.n; tail++) {
+    struct buf *b = &logbuf[tail];
+    acquiresleep(&b->lock);
+    b->dev = log.dev;
+    b->blockno = log.start+tail+1;
+    virtio_disk_rw(b, 0);
+    releasesleep(&b->lock);
+  }
+  install_trans();
+  log.dlh.n = 0;
   write_head(); // clear the log
 }
 
+// Install everything in the log and empty it, to make room.
+// Caller must have set log.committing.
+static void
+checkpoint(void)
+{
+  int tail;
+
+  install_trans();
+  for (tail = 0; tail < log.dlh.n; tail++)
+    bunpin(log.dev, log.dlh.block[tail]);
+  acquire(&log.lock);
+  log.dlh.n = 0;
+  release(&log.lock);
+  write_head();    // Erase the installed transactions from the log
+}
+
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    if(log.copying){
       sleep(&log, &log.lock);
+    } else if(LOGUSED + (log.outstanding+1)*MAXOPBLOCKS > LOGSLOTS){
+      // this op might exhaust log space.
+      if(log.dlh.n > 0 && !log.committing){
+        // make room by installing what's in the log.
+        log.committing = 1;
+        release(&log.lock);
+        checkpoint();
+        acquire(&log.lock);
+        log.committing = 0;
+        log.ncheckpoint++;
+        wakeup(&log);
+      } else {
+        // wait for commit.
+        sleep(&log, &log.lock);
+      }
     } else {
       log.outstanding += 1;
+      log.ops += 1;
       release(&log.lock);
       break;
     }
   }
 }
 
+// Should the open transaction be committed now?
+// Yes if it holds LOGCOMMITBLKS blocks, has been open for
+// LOGCOMMITTICKS ticks, or has no room for another op.
+// Caller must hold log.lock, and only asks once
+// log.outstanding is zero.
+static int
+ready(void)
+{
+  return log.lh.n >= LOGCOMMITBLKS ||
+         ticks - log.opened >= LOGCOMMITTICKS ||
+         LOGUSED + MAXOPBLOCKS > LOGSLOTS;
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and the transaction is ready.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
+  if(log.outstanding > 0){
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
     wakeup(&log);
+    release(&log.lock);
+    return;
+  }
+
+  // we are the last op of the open transaction, so it's up
+  // to us to commit it, unless another op joins meanwhile
+  // and takes over that job.
+  while(log.outstanding == 0 && log.lh.n > 0){
+    if(log.committing){
+      // wait for the previous transaction to finish.
+      sleep(&log, &log.lock);
+    } else if(!ready()){
+      // give other ops a chance to join.
+      sleep(&ticks, &log.lock);
+    } else {
+      log.committing = 1;
+      log.copying = 1;
+      log.clh = log.lh;
+      log.lh.n = 0;
+      log.nblock += log.clh.n;
+      log.nop += log.ops;
+      log.ops = 0;
+      release(&log.lock);
+
+      // call commit w/o holding locks, since not allowed
+      // to sleep with locks.
+      commit();
+
+      acquire(&log.lock);
+      log.committing = 0;
+      log.ncommit++;
+      wakeup(&log);
+      break;
+    }
   }
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the closed transaction's blocks from cache to the
+// logbuf[] entries after the ones already in the log, then
+// let new system calls go ahead.
+// The cached blocks stay pinned until they are installed,
+// so nobody can read a stale copy from disk meanwhile.
+static void
+copy_trans(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
+    memmove(logbuf[log.dlh.n+tail].data, from->data, BSIZE);
+    brelse(from);
   }
+
+  acquire(&log.lock);
+  log.copying = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Append the closed transaction's blocks to the log.
+// Starts all the writes before waiting for any, so that
+// the disk driver can merge them.
 static void
 write_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *b = &logbuf[log.dlh.n+tail];
+    acquiresleep(&b->lock);
+    b->dev = log.dev;
+    b->blockno = log.start+log.dlh.n+tail+1;
+    bawrite(b);  // write the log
+  }
+  for (tail = 0; tail < log.clh.n; tail++) {
+    bwait(&logbuf[log.dlh.n+tail]);
+    releasesleep(&logbuf[log.dlh.n+tail].lock);
   }
 }
 
+// begin_op() made sure that the closed transaction fits
+// in the log after the ones that are already there.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
-  }
+  int tail;
+
+  copy_trans();    // Snapshot the transaction
+  write_log();     // Append it to the log
+  acquire(&log.lock);
+  for (tail = 0; tail < log.clh.n; tail++)
+    log.dlh.block[log.dlh.n+tail] = log.clh.block[tail];
+  log.dlh.n += log.clh.n;
+  log.clh.n = 0;
+  release(&log.lock);
+  write_head();    // Write header to disk -- the real commit
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,8 +388,6 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
@@ -226,11 +395,44 @@ log_write(struct buf *b)
     if (log.lh.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    // begin_op() only reserved MAXOPBLOCKS for this op; one
+    // that needs more may use the whole log once committed
+    // transactions are installed.
+    while (LOGUSED >= LOGSLOTS) {
+      if (log.committing) {
+        sleep(&log, &log.lock);
+      } else if (log.dlh.n > 0) {
+        log.committing = 1;
+        release(&log.lock);
+        checkpoint();
+        acquire(&log.lock);
+        log.committing = 0;
+        log.ncheckpoint++;
+        wakeup(&log);
+      } else {
+        panic("too big a transaction");
+      }
+    }
+    log.lh.block[log.lh.n] = b->blockno;
     bpin(b);
+    if (log.lh.n == 0)
+      log.opened = ticks;
     log.lh.n++;
   }
   release(&log.lock);
 }
 
+// Format log counters for the statistics device.
+int
+logstats(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- log\ncommit %d blocks %d ops %d\n",
+               log.ncommit, log.nblock, log.nop);
+  n += snprintf(buf+n, sz-n, "checkpoint %d installed %d pending %d\n",
+                log.ncheckpoint, log.ninstall, log.dlh.n);
+  n += snprint_lock(buf+n, sz-n, &log.lock);
+  return n;
+}
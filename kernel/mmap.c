@@ -0,0 +1,446 @@
+//
+// Memory-mapped files and anonymous memory.
+//
+// mmap() only records a region in one of the process's
+// NVMA vma slots; vmfault() maps each page the first time
+// the process touches it. Regions are placed top-down below
+// the trapframe, and growproc() keeps the heap below the
+// lowest of them.
+//
+// A MAP_SHARED file page is the page cache page itself, so
+// every process that maps the file, and read() and write(),
+// see the same data; the page cache doesn't reuse a page
+// that is mapped. Such a page is mapped read-only until the
+// first store, which marks it dirty (PTE_D), and munmap(),
+// exit() and exec() write dirty pages back through the log.
+// A MAP_PRIVATE file page maps the page cache page
+// copy-on-write. Anonymous pages are zero-filled; fork()
+// shares MAP_SHARED ones with the child, and treats the
+// rest like any other memory.
+//
+// exec() maps a program's segments as MAP_PRIVATE regions
+// below p->sz, with the part past the segment's file size
+// zero-filled (see flen), so a program is paged in as it
+// runs, and every process running it shares the page cache
+// pages of its text until it writes them. Such regions are
+// part of the image, not above it: mmapbase(), munmap() and
+// fork() leave them to the code that manages [0, p->sz), and
+// growproc() cuts them back when sbrk() shrinks the image.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Return the region of p that contains va, or 0.
+static struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// Return an unused vma slot of p, or 0.
+static struct vma*
+freevma(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      return v;
+  }
+  return 0;
+}
+
+// Lowest address mapped by mmap(), or TRAPFRAME if none;
+// the heap must stay below it.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && v->addr >= p->sz && v->addr < base)
+      base = v->addr;
+  }
+  return base;
+}
+
+// Handle a fault at page-aligned va in region v. Unless
+// cansleep, only maps a file page that is in the page cache.
+// Returns 0 if the page is now present, -1 if the access
+// isn't allowed, there's no memory, or the page would have
+// to be read.
+static int
+mmapfault(struct proc *p, struct vma *v, uint64 va, int write, int cansleep)
+{
+  pte_t *pte;
+  struct inode *ip;
+  char *pa, *mem;
+  int perm;
+  uint64 o;
+
+  if(v->prot == PROT_NONE || (write && (v->prot & PROT_WRITE) == 0))
+    return -1;
+
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(!write || (*pte & PTE_W))
+      return -1;
+    if(*pte & PTE_COW)
+      return uvmfault(p->pagetable, va, 0, 1);
+    // first store to a shared file page.
+    *pte |= PTE_W | PTE_D;
+    return 0;
+  }
+
+  perm = PTE_U;
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  o = va - v->addr;
+  if(v->f == 0 || o >= v->flen){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  // a cached page needs no inode lock, so that processes
+  // running the same program don't contend for it.
+  ip = v->f->ip;
+  if((pa = ipagepeek(ip, (v->off + o) / PGSIZE)) == 0){
+    if(!cansleep)
+      return -1;
+    ilock(ip);
+    pa = ipagemap(ip, (v->off + o) / PGSIZE);
+    iunlock(ip);
+    if(pa == 0)
+      return -1;
+  }
+
+  if(v->flags & MAP_SHARED){
+    if(write)
+      perm |= PTE_D;
+    else
+      perm &= ~PTE_W;
+  } else if(write || o + PGSIZE > v->flen){
+    if((mem = kalloc()) == 0){
+      kfree(pa);
+      return -1;
+    }
+    memmove(mem, pa, PGSIZE);
+    if(o + PGSIZE > v->flen)
+      memset(mem + (v->flen - o), 0, PGSIZE - (v->flen - o));
+    kfree(pa);
+    pa = mem;
+  } else if(perm & PTE_W){
+    perm = (perm & ~PTE_W) | PTE_COW;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)pa, perm) != 0){
+    kfree(pa);
+    return -1;
+  }
+  return 0;
+}
+
+// Make the page of p's memory at va present after a fault,
+// or for the kernel to copy to (write=1) or from it.
+// Reading a file page in sleeps, so copyin() and copyout()
+// clear cansleep when their caller holds a spinlock or an
+// inode lock; see vmprefault().
+// Returns 0 on success, -1 if va isn't valid memory for
+// the access or the page couldn't be had without sleeping.
+int
+vmfault(struct proc *p, uint64 va, int write, int cansleep)
+{
+  struct vma *v;
+
+  if(va >= MAXVA)
+    return -1;
+  if((v = findvma(p, va)) == 0)
+    return uvmfault(p->pagetable, va, p->sz, write);
+  return mmapfault(p, v, PGROUNDDOWN(va), write, cansleep);
+}
+
+// Fault in the file pages of the current process's regions
+// in [va, va+n) that an access (a store if write) would fault
+// on, so that a copy to or from them needn't sleep. For
+// read(), write() and wait(), before they take the locks they
+// copy under. Leaves any error for the copy to report.
+void
+vmprefault(uint64 va, uint64 n, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint64 a, end;
+
+  if(va + n < va || va + n > MAXVA)
+    return;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || v->f == 0)
+      continue;
+    a = PGROUNDDOWN(va) > v->addr ? PGROUNDDOWN(va) : v->addr;
+    end = min(va + n, v->addr + v->len);
+    for(; a < end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+        continue;
+      mmapfault(p, v, a, write, 1);
+    }
+  }
+}
+
+// Write the page at pa back to the file at offset off,
+// as far as the file goes. Doesn't extend the file.
+static void
+writeback(struct inode *ip, char *pa, uint off)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n, n1;
+
+  ilock(ip);
+  n = off < ip->size ? min(PGSIZE, ip->size - off) : 0;
+  iunlock(ip);
+
+  for(i = 0; i < n; i += n1){
+    n1 = min(n - i, max);
+    begin_op();
+    ilock(ip);
+    if(off + i + n1 > ip->size)  // truncated meanwhile
+      n1 = off + i < ip->size ? ip->size - (off + i) : 0;
+    if(n1 > 0)
+      writei(ip, 0, (uint64)pa + i, off + i, n1);
+    iunlock(ip);
+    end_op();
+    if(n1 == 0)
+      break;
+  }
+}
+
+// Unmap [va, va+len) of region v, writing dirty shared
+// file pages back first. Leaves v itself alone.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  pte_t *pte;
+  uint64 a;
+
+  if(v->f && (v->flags & MAP_SHARED)){
+    for(a = va; a < va + len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0)
+        continue;
+      if((*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+        continue;
+      writeback(v->f->ip, (char*)PTE2PA(*pte), v->off + (a - v->addr));
+    }
+  }
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+}
+
+// Map len bytes of f starting at offset off, or anonymous
+// memory if f is 0, into the current process.
+// Returns the address, or -1.
+uint64
+mmap(struct file *f, uint64 len, int prot, int flags, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 base;
+
+  if(len == 0 || (off % PGSIZE) != 0)
+    return -1;
+  if(((flags & MAP_SHARED) == 0) == ((flags & MAP_PRIVATE) == 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || f->ip->type != T_FILE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  base = mmapbase(p);
+  if(len > base || base - len < PGROUNDUP(p->sz))
+    return -1;
+  if((v = freevma(p)) == 0)
+    return -1;
+
+  v->addr = base - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  v->flen = len;
+  return v->addr;
+}
+
+// Unmap [addr, addr+len) of the current process, which must
+// lie within one region mapped by mmap(). Unmapping the middle
+// of a region splits it in two. The program's own regions
+// below p->sz are part of the image, which only sbrk() shrinks.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv = 0;
+  uint64 end;
+
+  if((addr % PGSIZE) != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  end = addr + len;
+  if((v = findvma(p, addr)) == 0 || end < addr || end > v->addr + v->len)
+    return -1;
+  if(v->addr < p->sz)
+    return -1;
+  if(addr > v->addr && end < v->addr + v->len){
+    if((nv = freevma(p)) == 0)
+      return -1;
+  }
+
+  vmaunmap(p, v, addr, len);
+
+  if(nv){
+    *nv = *v;
+    nv->addr = end;
+    nv->len = v->addr + v->len - end;
+    nv->off = v->off + (end - v->addr);
+    nv->flen = v->flen > end - v->addr ? v->flen - (end - v->addr) : 0;
+    if(nv->f)
+      filedup(nv->f);
+    v->len = addr - v->addr;
+  } else if(addr == v->addr){
+    v->addr += len;
+    v->len -= len;
+    v->off += len;
+    v->flen = v->flen > len ? v->flen - len : 0;
+  } else {
+    v->len -= len;
+  }
+
+  if(v->len == 0){
+    if(v->f)
+      fileclose(v->f);
+    v->addr = 0;
+    v->f = 0;
+  }
+  return 0;
+}
+
+// p's image is shrinking from p->sz to sz: cut its regions
+// (see exec()) back to sz, so that growing it again gives
+// zeroed memory rather than the program's. The caller has
+// unmapped their pages.
+void
+mmapshrink(struct proc *p, uint64 sz)
+{
+  struct vma *v;
+
+  sz = PGROUNDUP(sz);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || v->addr >= p->sz || v->addr + v->len <= sz)
+      continue;
+    if(v->addr >= sz){
+      if(v->f)
+        fileclose(v->f);
+      v->addr = 0;
+      v->len = 0;
+      v->f = 0;
+    } else {
+      v->len = sz - v->addr;
+      v->flen = min(v->flen, v->len);
+    }
+  }
+}
+
+// Give child np the regions of p. Shared pages are
+// mapped into both; private ones become copy-on-write.
+// Returns 0 on success, -1 on failure, having undone
+// everything.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *w;
+  uint64 a;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || v->addr < p->sz)
+      continue;  // uvmcopy() has done the image
+    if(v->f == 0 && (v->flags & MAP_SHARED) && v->prot != PROT_NONE){
+      // fault in what p hasn't touched yet, or parent
+      // and child would each get a page of their own.
+      for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+        if(walkaddr(p->pagetable, a) == 0 && mmapfault(p, v, a, 0, 1) != 0)
+          goto bad;
+      }
+    }
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                (v->flags & MAP_SHARED) == 0) != 0)
+      goto bad;
+  }
+
+  for(v = p->vma, w = np->vma; v < &p->vma[NVMA]; v++, w++){
+    *w = *v;
+    if(w->f)
+      filedup(w->f);
+  }
+  return 0;
+
+ bad:
+  for(w = p->vma; w < v; w++){
+    if(w->len && w->addr >= p->sz)
+      uvmunmap(np->pagetable, w->addr, w->len / PGSIZE, 1);
+  }
+  return -1;
+}
+
+// Write back and unmap all of p's regions, for exit() and
+// exec(), except that the pages of regions below p->sz are
+// left for the code that frees the image.
+void
+mmapexit(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    // the image's pages go with the rest of [0, p->sz).
+    if(v->addr >= p->sz)
+      vmaunmap(p, v, v->addr, v->len);
+    if(v->f)
+      fileclose(v->f);
+    v->addr = 0;
+    v->len = 0;
+    v->f = 0;
+  }
+}
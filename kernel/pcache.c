@@ -0,0 +1,291 @@
+// Page cache.
+//
+// Holds the data of regular files in whole pages, keyed by
+// (dev, inum, page number), so that file data doesn't compete
+// with metadata for the few bufs in the buffer cache, and so
+// that the amount cached is limited only by free memory.
+//
+// Interface:
+// * readi() asks pclookup() for a page and, if it isn't
+//     cached, gets one from pcalloc() and fills it from disk.
+// * When done with a page, call pcput().
+// * writei() goes through the log and the buffer cache as
+//     before, and calls pcupdate() to keep a cached page
+//     up to date (write-through).
+// * itrunc() calls pcdrop() to discard a file's pages.
+// * kalloc() calls pcreclaim() when it runs out of memory.
+// * mmap() maps pages into page tables, taking a kref() on
+//     the memory (see ipagemap() in fs.c).
+//
+// A page's contents are protected by the file's inode lock;
+// pcache.lock protects the table, the lists, and ref.
+// Only pages with ref zero are on the LRU list, and only
+// those that no page table maps can be reclaimed.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "pcache.h"
+
+#define NPCHASH 257
+#define PCHASH(dev, inum, pgno) (((dev) * 31 + (inum) * 17 + (pgno)) % NPCHASH)
+
+struct {
+  struct spinlock lock;
+  struct cpage page[NPCACHE];
+  struct cpage *hash[NPCHASH];
+  struct cpage *free;   // entries without a page
+  struct cpage lru;     // unreferenced pages, oldest first,
+                        // circular through prev/next.
+  int npage;            // entries with a page
+  uint nhit;            // lookups that found the page
+  uint nmiss;           // ... that didn't
+  uint nrecycle;        // pages taken from another file's page
+  uint nreclaim;        // pages given back to kalloc()
+} pcache;
+
+static void pcfree(struct cpage*);
+
+void
+pcinit(void)
+{
+  int i;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.prev = &pcache.lru;
+  pcache.lru.next = &pcache.lru;
+  for(i = 0; i < NPCACHE; i++){
+    pcache.page[i].hnext = pcache.free;
+    pcache.free = &pcache.page[i];
+  }
+}
+
+static void
+lruunlink(struct cpage *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+}
+
+// Remove pg from its hash chain.
+// Caller must hold pcache.lock.
+static void
+unhash(struct cpage *pg)
+{
+  struct cpage **pp;
+
+  for(pp = &pcache.hash[PCHASH(pg->dev, pg->inum, pg->pgno)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == pg){
+      *pp = pg->hnext;
+      break;
+    }
+  }
+}
+
+// Return the least recently used page that can be reclaimed,
+// still on the LRU list, or 0 if there is none.
+// Caller must hold pcache.lock.
+static struct cpage*
+victim(void)
+{
+  struct cpage *pg;
+
+  for(pg = pcache.lru.next; pg != &pcache.lru; pg = pg->next){
+    if(krefcnt(pg->data) == 1)
+      return pg;
+  }
+  return 0;
+}
+
+// Caller must hold pcache.lock.
+static struct cpage*
+find(uint dev, uint inum, uint pgno)
+{
+  struct cpage *pg;
+
+  for(pg = pcache.hash[PCHASH(dev, inum, pgno)]; pg; pg = pg->hnext){
+    if(pg->dev == dev && pg->inum == inum && pg->pgno == pgno)
+      return pg;
+  }
+  return 0;
+}
+
+// Return page pgno of inode (dev, inum) with a reference
+// taken, or 0 if it isn't cached.
+struct cpage*
+pclookup(uint dev, uint inum, uint pgno)
+{
+  struct cpage *pg;
+
+  acquire(&pcache.lock);
+  if((pg = find(dev, inum, pgno)) != 0){
+    if(pg->ref++ == 0)
+      lruunlink(pg);
+    pcache.nhit++;
+  } else {
+    pcache.nmiss++;
+  }
+  release(&pcache.lock);
+  return pg;
+}
+
+// Make a page for page pgno of inode (dev, inum), which must
+// not be cached, with a reference taken and junk contents;
+// the caller fills it and then sets valid.
+// Uses a free page of memory if there is one, and otherwise
+// the least recently used cached page.
+// Returns 0 if there is neither.
+struct cpage*
+pcalloc(uint dev, uint inum, uint pgno)
+{
+  struct cpage *pg;
+  char *pa;
+
+  // don't hold pcache.lock in kalloc(), which may call
+  // pcreclaim().
+  pa = kalloc();
+
+  acquire(&pcache.lock);
+  if(pa && (pg = pcache.free) != 0){
+    pcache.free = pg->hnext;
+    pg->data = pa;
+    pcache.npage++;
+    pa = 0;
+  } else if((pg = victim()) != 0){
+    lruunlink(pg);
+    unhash(pg);
+    pcache.nrecycle++;
+  }
+  if(pg){
+    pg->dev = dev;
+    pg->inum = inum;
+    pg->pgno = pgno;
+    pg->ref = 1;
+    pg->valid = 0;
+    pg->hnext = pcache.hash[PCHASH(dev, inum, pgno)];
+    pcache.hash[PCHASH(dev, inum, pgno)] = pg;
+  }
+  release(&pcache.lock);
+
+  if(pa)
+    kfree(pa);
+  return pg;
+}
+
+// Drop a reference to pg.
+void
+pcput(struct cpage *pg)
+{
+  acquire(&pcache.lock);
+  if(pg->ref < 1)
+    panic("pcput");
+  if(--pg->ref == 0){
+    if(pg->inum == 0){  // dropped by pcdrop() meanwhile
+      pcfree(pg);
+      return;
+    }
+    pg->next = &pcache.lru;
+    pg->prev = pcache.lru.prev;
+    pcache.lru.prev->next = pg;
+    pcache.lru.prev = pg;
+  }
+  release(&pcache.lock);
+}
+
+// n bytes at offset off of inode (dev, inum) have been
+// written with the data at src; update the cached page,
+// if any. The bytes must all be in one page.
+// Caller must hold the inode's lock.
+void
+pcupdate(uint dev, uint inum, uint off, void *src, int n)
+{
+  struct cpage *pg;
+
+  acquire(&pcache.lock);
+  pg = find(dev, inum, off / PGSIZE);
+  if(pg && pg->ref++ == 0)
+    lruunlink(pg);
+  release(&pcache.lock);
+  if(pg){
+    memmove(pg->data + off % PGSIZE, src, n);
+    pcput(pg);
+  }
+}
+
+// Give pg's page back to kalloc() and free the entry.
+// pg must be off the LRU list and out of the hash table.
+// Caller must hold pcache.lock; releases it.
+static void
+pcfree(struct cpage *pg)
+{
+  char *pa;
+
+  pa = pg->data;
+  pg->data = 0;
+  pg->hnext = pcache.free;
+  pcache.free = pg;
+  pcache.npage--;
+  release(&pcache.lock);
+  kfree(pa);
+}
+
+// Discard every cached page of inode (dev, inum), whose
+// contents are going away, including pages past the end of
+// the file that mmap() has faulted in. A page that is still
+// referenced is only taken out of the hash table, and marked
+// (inum 0) for pcput() to free.
+// Caller must hold the inode's lock.
+void
+pcdrop(uint dev, uint inum)
+{
+  struct cpage *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++){
+    if(pg->data == 0 || pg->dev != dev || pg->inum != inum)
+      continue;
+    unhash(pg);
+    if(pg->ref != 0){
+      pg->inum = 0;
+      continue;
+    }
+    lruunlink(pg);
+    pcfree(pg);
+    acquire(&pcache.lock);
+  }
+  release(&pcache.lock);
+}
+
+// Give the least recently used unreferenced page back to
+// kalloc(). Returns 0 if there is none.
+int
+pcreclaim(void)
+{
+  struct cpage *pg;
+
+  acquire(&pcache.lock);
+  if((pg = victim()) == 0){
+    release(&pcache.lock);
+    return 0;
+  }
+  pcache.nreclaim++;
+  lruunlink(pg);
+  unhash(pg);
+  pcfree(pg);
+  return 1;
+}
+
+// Format page cache counters for the statistics device.
+int
+pcachestats(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- pcache\npages %d hit %d miss %d recycle %d reclaim %d\n",
+               pcache.npage, pcache.nhit, pcache.nmiss, pcache.nrecycle,
+               pcache.nreclaim);
+  n += snprint_lock(buf+n, sz-n, &pcache.lock);
+  return n;
+}
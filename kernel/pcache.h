@@ -0,0 +1,12 @@
+// A page of file data in the page cache.
+struct cpage {
+  uint dev;
+  uint inum;
+  uint pgno;            // which page of the file
+  int ref;              // being read or written by this many
+  int valid;            // has data been read from disk?
+  char *data;           // kalloc()ed page, or 0 if entry unused
+  struct cpage *hnext;  // hash chain, or free list
+  struct cpage *prev;   // LRU list of unreferenced pages
+  struct cpage *next;
+};
@@ -8,17 +8,58 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// A pipe's ring buffer is made of whole pages, which need not
+// be physically contiguous. It starts out one page long and
+// can be resized with the pipesize() system call, trading
+// memory for fewer sleep/wakeup round trips between the
+// reader and the writer.
+#define PIPEMAXPAGES 16  // must be a power of two
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *pages[PIPEMAXPAGES]; // ring buffer, size bytes in all
+  uint size;      // capacity; a power-of-two number of pages
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+// Return the address of byte i (mod size) of the ring,
+// and set *room to the number of bytes that follow it in
+// the same page. Since size is a multiple of PGSIZE, a
+// run that stays within a page never wraps.
+static char*
+pipeptr(struct pipe *pi, uint i, uint *room)
+{
+  uint off = i % pi->size;
+
+  *room = PGSIZE - off % PGSIZE;
+  return pi->pages[off / PGSIZE] + off % PGSIZE;
+}
+
+static void
+freepages(char **pages, int npages)
+{
+  for(int i = 0; i < npages; i++)
+    if(pages[i])
+      kfree(pages[i]);
+}
+
+// Fill pages[0..npages-1] with fresh pages.
+// Returns 0, or -1 (having freed any it got) if out of memory.
+static int
+allocpages(char **pages, int npages)
+{
+  for(int i = 0; i < npages; i++){
+    if((pages[i] = kalloc()) == 0){
+      freepages(pages, i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -30,6 +71,10 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  memset(pi->pages, 0, sizeof(pi->pages));
+  if(allocpages(pi->pages, 1) < 0)
+    goto bad;
+  pi->size = PGSIZE;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -68,13 +113,81 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
+    freepages(pi->pages, pi->size / PGSIZE);
     kfree((char*)pi);
   } else
     release(&pi->lock);
 }
 
+// Change the capacity of pipe pi to n bytes, rounded up to
+// a power-of-two number of pages, so that the capacity keeps
+// dividing 2^32 and nread/nwrite can wrap around safely.
+// n == 0 leaves it unchanged.
+// Fails if n is too large or smaller than the data
+// currently buffered.
+// Returns the capacity, or -1.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipesize(struct pipe *pi, int n)
+{
+  char *pages[PIPEMAXPAGES], *old[PIPEMAXPAGES];
+  int npages, oldnpages;
+  uint i, cnt, room;
+
+  if(n < 0 || n > PIPEMAXPAGES*PGSIZE)
+    return -1;
+  if(n == 0)
+    return pi->size;
+
+  for(npages = 1; npages*PGSIZE < n; npages *= 2)
+    ;
+  memset(pages, 0, sizeof(pages));
+  if(allocpages(pages, npages) < 0)
+    return -1;
+
+  acquire(&pi->lock);
+  cnt = pi->nwrite - pi->nread;
+  if(cnt > npages*PGSIZE){
+    release(&pi->lock);
+    freepages(pages, npages);
+    return -1;
+  }
+
+  // Move the buffered bytes to the start of the new ring.
+  for(i = 0; i < cnt; ){
+    char *src = pipeptr(pi, pi->nread + i, &room);
+    if(room > cnt - i)
+      room = cnt - i;
+    if(room > PGSIZE - i % PGSIZE)
+      room = PGSIZE - i % PGSIZE;
+    memmove(pages[i / PGSIZE] + i % PGSIZE, src, room);
+    i += room;
+  }
+
+  oldnpages = pi->size / PGSIZE;
+  memmove(old, pi->pages, sizeof(old));
+  memmove(pi->pages, pages, sizeof(pages));
+  pi->size = npages * PGSIZE;
+  pi->nread = 0;
+  pi->nwrite = cnt;
+  wakeup(&pi->nwrite);  // there may be more room now
+  release(&pi->lock);
+
+  freepages(old, oldnpages);
+  return npages * PGSIZE;
+}
+
+// Copy up to n bytes into the pipe from addr, a user
+// address if user_src, else a kernel address.
+// If block, sleep while the pipe is full until all n bytes
+// are written; otherwise write only what fits right now.
+// Bytes move in contiguous runs, bounded by the free space,
+// the end of the ring page and, for a user address, the end
+// of the user page, so that each copyin() walks the page
+// table once rather than once per byte.
+// Returns the number of bytes written, or -1 if the read
+// end is closed or the process has been killed.
+static int
+pipein(struct pipe *pi, int user_src, uint64 addr, int n, int block)
 {
   int i = 0;
   struct proc *pr = myproc();
@@ -85,15 +198,24 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+    if(pi->nwrite == pi->nread + pi->size){ //DOC: pipewrite-full
+      if(!block)
+        break;
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      uint m;
+      char *dst = pipeptr(pi, pi->nwrite, &m);
+      if(m > pi->size - (pi->nwrite - pi->nread))
+        m = pi->size - (pi->nwrite - pi->nread);   // free space
+      if(m > n - i)
+        m = n - i;
+      if(user_src && m > PGSIZE - (addr + i) % PGSIZE)
+        m = PGSIZE - (addr + i) % PGSIZE;          // up to the page end
+      if(either_copyin(dst, user_src, addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -102,29 +224,173 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   return i;
 }
 
-int
-piperead(struct pipe *pi, uint64 addr, int n)
+// Copy up to n bytes out of the pipe to addr, a user
+// address if user_dst, else a kernel address.
+// If block, first sleep until there is at least one byte
+// (or the write end is closed). Unless consume is set, the
+// bytes stay in the pipe for the next reader.
+// Like pipein(), moves contiguous runs at a time.
+// Returns the number of bytes read, or -1 if the process
+// has been killed.
+static int
+pipeout(struct pipe *pi, int user_dst, uint64 addr, int n, int block, int consume)
 {
   int i;
+  uint pos;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(block && pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(pr->killed){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  i = 0;
+  pos = pi->nread;
+  while(i < n && pos != pi->nwrite){  //DOC: piperead-copy
+    uint m;
+    char *src = pipeptr(pi, pos, &m);
+    if(m > pi->nwrite - pos)
+      m = pi->nwrite - pos;                 // bytes available
+    if(m > n - i)
+      m = n - i;
+    if(user_dst && m > PGSIZE - (addr + i) % PGSIZE)
+      m = PGSIZE - (addr + i) % PGSIZE;     // up to the page end
+    if(either_copyout(user_dst, addr + i, src, m) == -1)
       break;
+    pos += m;
+    i += m;
+  }
+  if(consume){
+    pi->nread = pos;
+    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// Write n bytes to the pipe, sleeping while it is full.
+int
+pipewrite(struct pipe *pi, int user_src, uint64 addr, int n)
+{
+  return pipein(pi, user_src, addr, n, 1);
+}
+
+// Read up to n bytes from the pipe, sleeping until
+// there is something to read.
+int
+piperead(struct pipe *pi, int user_dst, uint64 addr, int n)
+{
+  return pipeout(pi, user_dst, addr, n, 1, 1);
+}
+
+// Like piperead(), but leave the data in the pipe.
+int
+pipepeek(struct pipe *pi, int user_dst, uint64 addr, int n)
+{
+  return pipeout(pi, user_dst, addr, n, 1, 0);
+}
+
+// Move up to n bytes from pipe from to pipe to without
+// sleeping: as many as are there and fit. Holds both locks
+// (taken in address order, so that moves in the other
+// direction can't deadlock) so that the bytes leave one
+// pipe only as they enter the other, and no other reader
+// of from can see them in between.
+// Returns the number of bytes moved, or -1 if the read end
+// of to is closed.
+int
+pipemove(struct pipe *from, struct pipe *to, int n)
+{
+  struct pipe *first, *second;
+  char *src, *dst;
+  uint m, m1;
+  int i;
+
+  first = from < to ? from : to;
+  second = from < to ? to : from;
+  acquire(&first->lock);
+  acquire(&second->lock);
+  if(to->readopen == 0){
+    release(&second->lock);
+    release(&first->lock);
+    return -1;
+  }
+  i = 0;
+  while(i < n && from->nread != from->nwrite && to->nwrite != to->nread + to->size){
+    src = pipeptr(from, from->nread, &m);
+    dst = pipeptr(to, to->nwrite, &m1);
+    if(m > m1)
+      m = m1;
+    if(m > from->nwrite - from->nread)
+      m = from->nwrite - from->nread;           // bytes available
+    if(m > to->size - (to->nwrite - to->nread))
+      m = to->size - (to->nwrite - to->nread);  // free space
+    if(m > n - i)
+      m = n - i;
+    memmove(dst, src, m);
+    from->nread += m;
+    to->nwrite += m;
+    i += m;
+  }
+  if(i > 0){
+    wakeup(&from->nwrite);
+    wakeup(&to->nread);
+  }
+  release(&second->lock);
+  release(&first->lock);
+  return i;
+}
+
+// Write up to n bytes to the pipe without sleeping.
+int
+pipewrite_nb(struct pipe *pi, int user_src, uint64 addr, int n)
+{
+  return pipein(pi, user_src, addr, n, 0);
+}
+
+// Read up to n bytes from the pipe without sleeping.
+int
+piperead_nb(struct pipe *pi, int user_dst, uint64 addr, int n)
+{
+  return pipeout(pi, user_dst, addr, n, 0, 1);
+}
+
+// Sleep until the pipe has room to write (forwrite) or
+// something to read (!forwrite), so that callers can then
+// use the non-blocking calls without holding other locks
+// while they wait.
+// Returns 1 when ready, 0 at end of file (nothing to read
+// and the write end closed), or -1 if the read end is
+// closed to a writer or the process has been killed.
+int
+pipewait(struct pipe *pi, int forwrite)
+{
+  struct proc *pr = myproc();
+  int r;
+
+  acquire(&pi->lock);
+  for(;;){
+    if(pr->killed || (forwrite && pi->readopen == 0)){
+      r = -1;
+      break;
+    }
+    if(forwrite && pi->nwrite != pi->nread + pi->size){
+      r = 1;
+      break;
+    }
+    if(!forwrite && pi->nread != pi->nwrite){
+      r = 1;
+      break;
+    }
+    if(!forwrite && pi->writeopen == 0){
+      r = 0;
+      break;
+    }
+    sleep(forwrite ? &pi->nwrite : &pi->nread, &pi->lock);
+  }
+  release(&pi->lock);
+  return r;
+}
@@ -26,6 +26,42 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
+// Per-CPU run queues of RUNNABLE processes.
+// A process is put on a queue when it becomes RUNNABLE
+// (see setrunnable()) and taken off by the scheduler that
+// runs it, so choosing the next process is O(1) and each
+// CPU mostly touches only its own queue. A CPU whose queue
+// is empty steals from the others.
+// Lock order: p->lock, then a runq lock; never two runq locks.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;     // FIFO, linked through p->rqnext
+  struct proc *tail;
+  int len;
+  uint nenq;             // processes put on this queue
+  uint nrun;             // processes this CPU switched to
+  uint nsteal;           // of those, how many were stolen
+  uint nidle;            // scheduler passes that found nothing
+} runq[NCPU];
+
+// Sleeping processes, hashed by the channel they sleep on,
+// so that wakeup() only looks at processes that might be
+// waiting on its channel. A sleeping process is on the
+// queue for p->chan from sleep() until wakeup() or kill()
+// makes it RUNNABLE.
+// Lock order: sleepq lock, then p->lock.
+#define NSLEEPQ 61
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;     // linked through p->sqnext
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[((uint64)chan >> 3) % NSLEEPQ];
+}
+
 // Allocate a page for each process's kernel stack.
 // Map it high in memory, followed by an invalid
 // guard page.
@@ -50,8 +86,13 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      p->cpu = -1;
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -163,6 +204,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->cpu = -1;
   p->state = UNUSED;
 }
 
@@ -242,26 +284,35 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; each new page is allocated
+// and zeroed when first touched (see uvmfault()).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(-(long)n > sz)
+      return -1;
+    // split a superpage that the new end cuts now, while
+    // running out of memory can still fail the call.
+    if(uvmsplit(p->pagetable, PGROUNDUP(sz + n)) != 0)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    mmapshrink(p, sz);
   }
   p->sz = sz;
   return 0;
@@ -289,6 +340,12 @@ fork(void)
   }
   np->sz = p->sz;
 
+  if(mmapfork(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -312,7 +369,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -344,6 +401,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and unmap mmap()ed regions.
+  mmapexit(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -387,6 +447,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // copyout() can't read in a mapped file page under wait_lock.
+  if(addr != 0)
+    vmprefault(addr, sizeof(int), 1);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -427,10 +491,108 @@ wait(uint64 addr)
   }
 }
 
+// Send an IPI to the first idle CPU at or after id, so
+// that it leaves wfi and picks up newly queued work.
+// If none is idle, a busy CPU will find the work soon enough.
+static void
+kick(int id)
+{
+  int i;
+
+  // pairs with the barrier in idle(): either that CPU
+  // sees the queued process, or we see it idle.
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++, id = (id + 1) % NCPU){
+    if(cpus[id].idle){
+      __sync_fetch_and_add(&cpus[id].nipi, 1);
+      *(volatile uint32*)CLINT_MSIP(id) = 1;
+      return;
+    }
+  }
+}
+
+// Called by scheduler() when no process is runnable.
+// Wait in wfi until an interrupt arrives, which is either
+// a device, the timer, or an IPI from kick().
+static void
+idle(struct cpu *c)
+{
+  uint64 t0;
+  int i;
+
+  // with interrupts off, an IPI sent after the check below
+  // stays pending and makes wfi return at once.
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++)
+    if(runq[i].len > 0)
+      break;
+  if(i == NCPU){
+    t0 = r_time();
+    asm volatile("wfi");
+    c->idletime += r_time() - t0;
+  }
+  c->idle = 0;
+}
+
+// Mark p RUNNABLE and queue it on the run queue of the
+// CPU it last ran on, which likely still has its state in
+// cache. New processes go on the current CPU's queue.
+// Caller must hold p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+
+  push_off();
+  if(p->cpu < 0)
+    p->cpu = cpuid();
+  pop_off();
+
+  p->state = RUNNABLE;
+  rq = &runq[p->cpu];
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->len++;
+  rq->nenq++;
+  release(&rq->lock);
+
+  kick(p->cpu);
+}
+
+// Take the process at the head of rq's queue, or return 0.
+static struct proc*
+dequeue(struct runq *rq)
+{
+  struct proc *p;
+
+  acquire(&rq->lock);
+  p = rq->head;
+  if(p){
+    rq->head = p->rqnext;
+    if(rq->head == 0)
+      rq->tail = 0;
+    p->rqnext = 0;
+    rq->len--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue, or
+//    steal one from another CPU's queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -439,28 +601,48 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
-  
+  int i, id, stolen;
+
+  id = cpuid();
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    stolen = 0;
+    p = dequeue(&runq[id]);
+    for(i = 1; p == 0 && i < NCPU; i++){
+      // peek at len without the lock so that idle CPUs
+      // don't hammer the locks of empty queues.
+      if(runq[(id + i) % NCPU].len > 0)
+        p = dequeue(&runq[(id + i) % NCPU]);
+      stolen = 1;
     }
+    if(p == 0){
+      runq[id].nidle++;
+      idle(c);
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    runq[id].nrun++;
+    if(stolen)
+      runq[id].nsteal++;
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -497,7 +679,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -529,20 +711,24 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = chanq(chan);
   
-  // Must acquire p->lock in order to
+  // Must put p on chan's sleep queue before releasing lk;
+  // wakeup(chan) locks the sleep queue, so once we hold
+  // q->lock we can be guaranteed that we won't miss any
+  // wakeup. Must also acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
 
-  acquire(&p->lock);  //DOC: sleeplock1
+  acquire(&q->lock);  //DOC: sleeplock1
+  acquire(&p->lock);
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = q->head;
+  q->head = p;
+  release(&q->lock);
 
   sched();
 
@@ -559,17 +745,44 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *q = chanq(chan);
+  struct proc *p, **pp;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  acquire(&q->lock);
+  for(pp = &q->head; (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->sqnext;
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+      setrunnable(p);
+      release(&p->lock);
+    } else {
+      pp = &p->sqnext;
+    }
+  }
+  release(&q->lock);
+}
+
+// Wake p if it is still asleep on chan.
+// Must be called without any p->lock.
+static void
+unsleep(struct proc *p, void *chan)
+{
+  struct sleepq *q = chanq(chan);
+  struct proc **pp;
+
+  acquire(&q->lock);
+  for(pp = &q->head; *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      acquire(&p->lock);
+      if(p->state == SLEEPING && p->chan == chan){
+        *pp = p->sqnext;
+        setrunnable(p);
       }
       release(&p->lock);
+      break;
     }
   }
+  release(&q->lock);
 }
 
 // Kill the process with the given pid.
@@ -579,16 +792,18 @@ int
 kill(int pid)
 {
   struct proc *p;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      chan = p->state == SLEEPING ? p->chan : 0;
       release(&p->lock);
+      // Wake process from sleep(). Can't hold p->lock
+      // while taking the sleep queue's lock.
+      if(chan)
+        unsleep(p, chan);
       return 0;
     }
     release(&p->lock);
@@ -654,3 +869,27 @@ procdump(void)
     printf("\n");
   }
 }
+
+// Format scheduler counters for the statistics device.
+int
+schedstats(char *buf, int sz)
+{
+  int i, n;
+  uint64 now;
+
+  now = r_time();
+  n = snprintf(buf, sz, "--- sched\n");
+  for(i = 0; i < NCPU; i++){
+    if(runq[i].nrun == 0 && runq[i].nenq == 0)
+      continue;
+    n += snprintf(buf+n, sz-n,
+                  "cpu%d: len %d enq %d run %d steal %d idle %d ipi %d\n",
+                  i, runq[i].len, runq[i].nenq, runq[i].nrun,
+                  runq[i].nsteal, runq[i].nidle, cpus[i].nipi);
+    n += snprintf(buf+n, sz-n, "cpu%d: idle time %ld of %ld (%d%%)\n",
+                  i, cpus[i].idletime, now,
+                  (int)(now ? cpus[i].idletime * 100 / now : 0));
+    n += snprint_lock(buf+n, sz-n, &runq[i].lock);
+  }
+  return n;
+}
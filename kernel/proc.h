@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in wfi for work (see idle())?
+  uint64 idletime;            // Time spent idle, in time CSR cycles.
+  uint nipi;                  // IPIs sent to wake this CPU.
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +83,17 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of user memory set up by mmap().
+struct vma {
+  uint64 addr;                 // Start, page-aligned
+  uint64 len;                  // Length, a multiple of PGSIZE; 0 if slot unused
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, MAP_ANON
+  struct file *f;              // Mapped file, or 0 if MAP_ANON
+  uint off;                    // Offset in f of addr
+  uint64 flen;                 // Bytes of f mapped; the rest is zero-filled
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -92,6 +106,13 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p goes on, or -1
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next on run queue
+
+  // the sleep queue's lock must be held when using this:
+  struct proc *sqnext;         // Next on sleep queue for chan
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -103,6 +124,8 @@ struct proc {
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // Memory-mapped regions
   struct inode *cwd;           // Current directory
+  int nilock;                  // Inode locks held, see vmfault()
   char name[16];               // Process name (debugging)
 };
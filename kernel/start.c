@@ -11,7 +11,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][7];
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -72,9 +72,13 @@ timerinit()
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : address of CLINT MSIP register, for IPIs.
+  // scratch[6] : set by timervec when it forwards a timer interrupt.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = CLINT_MSIP(id);
+  scratch[6] = 0;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -83,6 +87,20 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts.
+  // the latter are IPIs sent by the scheduler (see kick()
+  // in proc.c), which timervec also forwards.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
+
+  // let supervisor mode read the time CSR, for idle accounting.
+  w_mcounteren(r_mcounteren() | 2);
+}
+
+// Did the most recent supervisor software interrupt on this
+// CPU come from the timer, rather than from an IPI?
+// Clears the indication. Interrupts must be disabled.
+int
+timertick(void)
+{
+  return __sync_lock_test_and_set(&timer_scratch[cpuid()][6], 0);
 }
@@ -0,0 +1,87 @@
+//
+// The statistics device: reading it returns a text
+// snapshot of kernel performance counters.
+//
+//   $ cat statistics
+//
+// Each subsystem that keeps counters provides a function
+// that formats them into a buffer; add it to statsfns[].
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+
+static int (*statsfns[])(char*, int) = {
+  kallocstats,
+  vmstats,
+  bcachestats,
+  pcachestats,
+  rastats,
+  logstats,
+  fsstats,
+  schedstats,
+  virtio_disk_stats,
+};
+
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} stats;
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+// The snapshot is taken on the first read and handed
+// out until it is used up, at which point read returns 0
+// and the next read starts a fresh snapshot.
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int i, m;
+
+  acquire(&stats.lock);
+
+  if(stats.sz == 0){
+    for(i = 0; i < NELEM(statsfns); i++)
+      stats.sz += statsfns[i](stats.buf + stats.sz, BUFSZ - stats.sz);
+  }
+
+  m = stats.sz - stats.off;
+  if(m > 0){
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, stats.buf + stats.off, m) == -1)
+      m = -1;
+    else
+      stats.off += m;
+  } else {
+    m = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
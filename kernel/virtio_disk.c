@@ -17,6 +17,9 @@
 #include "buf.h"
 #include "virtio.h"
 
+// most blocks merged into one request.
+#define MAXSEG 8
+
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
@@ -57,17 +60,29 @@ static struct disk {
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
+  // bufs passed to virtio_disk_start() that haven't been
+  // given to the device yet, oldest first, linked through
+  // b->qnext.
+  struct buf *head;
+  struct buf *tail;
+
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // the request's bufs, linked through b->qnext
     char status;
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  // counters, protected by vdisk_lock.
+  uint nreq;       // requests given to the device
+  uint nbuf;       // bufs in those requests
+  int inflight;    // requests the device is working on
+  int maxinflight;
   
   struct spinlock vdisk_lock;
   
@@ -166,7 +181,6 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -184,12 +198,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,88 +213,154 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Give queued bufs to the device. A run of bufs with
+// consecutive block numbers in the same direction goes as a
+// single request of up to MAXSEG blocks. Stops when there
+// aren't enough free descriptors; virtio_disk_intr() calls
+// submit() again when a request completes.
+// Caller must hold vdisk_lock.
+static void
+submit(void)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  struct buf *b, *last;
+  int i, n, notify;
+  int idx[MAXSEG+2];
+
+  notify = 0;
+  while((b = disk.head) != 0){
+    n = 1;
+    for(last = b; n < MAXSEG && last->qnext; last = last->qnext, n++){
+      if(last->qnext->dwrite != b->dwrite ||
+         last->qnext->blockno != last->blockno + 1)
+        break;
+    }
 
-  acquire(&disk.vdisk_lock);
+    // the spec's Section 5.2 says that legacy block operations use
+    // a descriptor for type/reserved/sector, descriptors for the
+    // data, and one for a 1-byte status result.
+    if(alloc_descs(idx, n+2) < 0)
+      break;
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+    disk.head = last->qnext;
+    if(disk.head == 0)
+      disk.tail = 0;
+    last->qnext = 0;
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+    // format the descriptors.
+    // qemu's virtio-blk.c reads them.
 
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
+    struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+    if(b->dwrite)
+      buf0->type = VIRTIO_BLK_T_OUT; // write the disk
+    else
+      buf0->type = VIRTIO_BLK_T_IN; // read the disk
+    buf0->reserved = 0;
+    buf0->sector = b->blockno * (BSIZE / 512);
+
+    disk.desc[idx[0]].addr = (uint64) buf0;
+    disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
+    disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
+    disk.desc[idx[0]].next = idx[1];
+
+    for(i = 1, last = b; i <= n; i++, last = last->qnext){
+      disk.desc[idx[i]].addr = (uint64) last->data;
+      disk.desc[idx[i]].len = BSIZE;
+      if(b->dwrite)
+        disk.desc[idx[i]].flags = 0; // device reads b->data
+      else
+        disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+      disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+      disk.desc[idx[i]].next = idx[i+1];
+    }
 
-  if(write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
-  buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    disk.info[idx[0]].status = 0xff; // device writes 0 on success
+    disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+    disk.desc[idx[n+1]].len = 1;
+    disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+    disk.desc[idx[n+1]].next = 0;
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record the bufs for virtio_disk_intr().
+    disk.info[idx[0]].b = b;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+    // tell the device the first index in our chain of descriptors.
+    disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+    __sync_synchronize();
 
-  __sync_synchronize();
+    // tell the device another avail ring entry is available.
+    disk.avail->idx += 1; // not % NUM ...
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+    disk.nreq++;
+    disk.nbuf += n;
+    if(++disk.inflight > disk.maxinflight)
+      disk.maxinflight = disk.inflight;
+    notify = 1;
+  }
 
-  __sync_synchronize();
+  if(notify){
+    __sync_synchronize();
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  }
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Queue a read or write of b without waiting for it.
+// The caller must hold b's sleep-lock until a matching
+// virtio_disk_wait(b) returns, or until b->iodone is
+// called. Queued bufs are held back until someone waits
+// (or the device finishes something), so that a caller
+// that starts several adjacent blocks before waiting gets
+// them merged into one request.
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  b->disk = 1;
+  b->dwrite = write;
+  b->qnext = 0;
+  if(disk.tail)
+    disk.tail->qnext = b;
+  else
+    disk.head = b;
+  disk.tail = b;
+  release(&disk.vdisk_lock);
+}
+
+// Give queued bufs to the device, for callers that
+// started operations but aren't going to wait for them.
+void
+virtio_disk_submit(void)
+{
+  acquire(&disk.vdisk_lock);
+  submit();
+  release(&disk.vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// Wait for virtio_disk_intr() to say that the operation
+// started on b has finished.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  submit();
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
+  struct buf *b, *next;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -304,12 +383,35 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    for(b = disk.info[id].b; b; b = next){
+      next = b->qnext;
+      b->qnext = 0;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      if(b->iodone)
+        b->iodone(b);
+    }
+    disk.info[id].b = 0;
+    free_chain(id);
+    disk.inflight--;
 
     disk.used_idx += 1;
   }
 
+  // keep the device busy with whatever has queued up.
+  submit();
+
   release(&disk.vdisk_lock);
 }
+
+// Format disk counters for the statistics device.
+int
+virtio_disk_stats(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- disk\nreq %d buf %d inflight %d max %d\n",
+               disk.nreq, disk.nbuf, disk.inflight, disk.maxinflight);
+  n += snprint_lock(buf+n, sz-n, &disk.vdisk_lock);
+  return n;
+}
@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,7 +17,17 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// superpage counters, for the statistics device.
+static struct {
+  uint npromote;  // superpages formed by promote()
+  uint ndemote;   // superpages split into 512 pages
+  uint nshare;    // whole superpages shared by uvmshare()
+  uint nreuse;    // splits that reused a freed page as the page table
+} vmstat;
+
 // Make a direct-map page table for the kernel.
+// kvmmap() uses superpages where it can, so most of RAM
+// takes one PTE per 2 megabytes.
 pagetable_t
 kvmmake(void)
 {
@@ -30,6 +42,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT software interrupt registers, for IPIs.
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -77,6 +92,10 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE can be a leaf that maps a whole 2-megabyte
+// superpage, in which case walk() returns it; superpage()
+// tells the caller so.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -86,6 +105,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -97,6 +118,40 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the level-1 PTE for va, which
+// either maps va's superpage or points to a level-0 page
+// table. If alloc!=0, create the level-1 page-table page
+// if need be.
+static pte_t *
+walk1(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walk1");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      return 0;
+    memset(pagetable, 0, PGSIZE);
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// Is va in a superpage?
+static int
+superpage(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  pte = walk1(pagetable, va, 0);
+  return pte && (*pte & PTE_V) && PTE_LEAF(*pte);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -117,17 +172,147 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(superpage(pagetable, va))
+    pa += PGROUNDDOWN(va) % SUPERPGSIZE;
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table,
+// with superpages wherever va and pa are both aligned.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && sz >= SUPERPGSIZE){
+      if(mapsuper(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+      n = SUPERPGSIZE;
+    } else {
+      // 4096-byte pages up to the next superpage boundary.
+      n = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - va;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
+}
+
+// Map the superpage at va to the 2 megabytes of physical
+// memory at pa, with a level-1 leaf PTE. va and pa must be
+// superpage-aligned. Returns 0 on success, -1 if walk1()
+// couldn't allocate a needed page-table page.
+int
+mapsuper(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+
+  if((va % SUPERPGSIZE) != 0 || (pa % SUPERPGSIZE) != 0)
+    panic("mapsuper: not aligned");
+  if((pte = walk1(pagetable, va, 1)) == 0)
+    return -1;
+  if(*pte & PTE_V)
+    panic("mapsuper: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
+// Split the superpage that maps va into 512 ordinary PTEs
+// for the same pages, with the same permissions, in the
+// page-table page pt, or in a new one if pt is 0.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pagetable_t pagetable, uint64 va, pagetable_t pt)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  int i;
+
+  pte = walk1(pagetable, va, 0);
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  if(pt == 0 && (pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(i = 0; i < SUPERPGSIZE/PGSIZE; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  __sync_fetch_and_add(&vmstat.ndemote, 1);
+  return 0;
+}
+
+// If va is inside a superpage rather than at its start, split
+// the superpage, so that a later uvmunmap() from va up needn't
+// allocate. A private page at va needs no split here, since
+// uvmunmap() reuses it as the page-table page.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  uint64 pa;
+
+  if(va % SUPERPGSIZE == 0 || va >= MAXVA || !superpage(pagetable, va))
+    return 0;
+  pa = PTE2PA(*walk1(pagetable, va, 0)) + va % SUPERPGSIZE;
+  if(krefcnt((void*)pa) == 1)
+    return 0;
+  return demote(pagetable, va, 0);
+}
+
+// If the superpage-aligned region around va is below sz and
+// every page of it is present, private, and mapped read-write,
+// move it into a superpage, freeing the pages and their
+// page-table page. Does nothing if there's no superpage free.
+static void
+promote(pagetable_t pagetable, uint64 va, uint64 sz)
+{
+  uint64 base, pa;
+  pte_t *pte;
+  pagetable_t pt;
+  char *mem;
+  int i;
+
+  base = SUPERPGROUNDDOWN(va);
+  if(base + SUPERPGSIZE > sz)
+    return;
+  pte = walk1(pagetable, base, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return;
+  pt = (pagetable_t)PTE2PA(*pte);
+  for(i = 0; i < SUPERPGSIZE/PGSIZE; i++){
+    if((PTE_FLAGS(pt[i]) & ~(PTE_A|PTE_D)) != (PTE_V|PTE_R|PTE_W|PTE_X|PTE_U))
+      return;
+    if(krefcnt((void*)PTE2PA(pt[i])) != 1)
+      return;
+  }
+
+  if((mem = kallocorder(SUPERPGORDER)) == 0)
+    return;
+  for(i = 0; i < SUPERPGSIZE/PGSIZE; i++){
+    pa = PTE2PA(pt[i]);
+    memmove(mem + i*PGSIZE, (char*)pa, PGSIZE);
+    kfree((void*)pa);
+  }
+  *pte = PA2PTE(mem) | PTE_V|PTE_R|PTE_W|PTE_X|PTE_U;
+  kfree((void*)pt);
+  __sync_fetch_and_add(&vmstat.npromote, 1);
+}
+
+// Format superpage counters for the statistics device.
+int
+vmstats(char *buf, int sz)
+{
+  return snprintf(buf, sz,
+                  "--- vm\nsuperpage promote %d demote %d share %d reuse %d\n",
+                  vmstat.npromote, vmstat.ndemote, vmstat.nshare,
+                  vmstat.nreuse);
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -160,22 +345,48 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in (see
+// uvmfault()) are skipped. A superpage that is only partly
+// in the range is split first; that can need a page of
+// memory, so callers that can fail split it beforehand with
+// uvmsplit().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end, pa;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    if(superpage(pagetable, a)){
+      pte = walk1(pagetable, a, 0);
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          kfreeorder((void*)PTE2PA(*pte), SUPERPGORDER);
+        *pte = 0;
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      pa = PTE2PA(*pte) + a % SUPERPGSIZE;
+      if(do_free && krefcnt((void*)pa) == 1){
+        // the page at a is going, so it can hold the
+        // page-table page for the rest.
+        demote(pagetable, a, (pagetable_t)pa);
+        *walk(pagetable, a, 0) = 0;
+        __sync_fetch_and_add(&vmstat.nreuse, 1);
+        continue;
+      }
+      if(demote(pagetable, a, 0) != 0)
+        panic("uvmunmap: demote");
+    }
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -291,42 +502,187 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Map the pages of old in [va, va+len) that are present
+// into new as well, each gaining a reference. If cow is set,
+// each writable page is first made read-only with PTE_COW
+// in old, so that uvmcow() copies it on the first store;
+// otherwise the pages are simply shared.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
+// unmaps any pages it mapped on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
-
-  for(i = 0; i < sz; i += PGSIZE){
+  int j;
+
+  for(i = va; i < va + len; i += PGSIZE){
+    if(superpage(old, i)){
+      if(i % SUPERPGSIZE == 0 && i + SUPERPGSIZE <= va + len){
+        pte = walk1(old, i, 0);
+        if(cow && (*pte & PTE_W))
+          *pte = (*pte & ~PTE_W) | PTE_COW;
+        pa = PTE2PA(*pte);
+        if(mapsuper(new, i, pa, PTE_FLAGS(*pte)) != 0)
+          goto err;
+        for(j = 0; j < SUPERPGSIZE/PGSIZE; j++)
+          kref((void*)(pa + j*PGSIZE));
+        __sync_fetch_and_add(&vmstat.nshare, 1);
+        i += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      if(demote(old, i, 0) != 0)
+        goto err;
+    }
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;  // not faulted in yet
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kref((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Given a parent process's page table, make the
+// child share its memory copy-on-write.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Give the process a private, writable copy of the
+// copy-on-write page containing va.
+// Returns 0 on success, -1 if va is not a COW page
+// or there is no memory for the copy.
+static int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int i;
+
+  if(superpage(pagetable, va)){
+    pte = walk1(pagetable, va, 0);
+    if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+      return -1;
+    pa = PTE2PA(*pte);
+    for(i = 0; i < SUPERPGSIZE/PGSIZE; i++){
+      if(krefcnt((void*)(pa + i*PGSIZE)) != 1)
+        break;
+    }
+    if(i == SUPERPGSIZE/PGSIZE){
+      // no longer shared at all.
+      *pte = (*pte & ~PTE_COW) | PTE_W;
+      return 0;
+    }
+    // copy just the page written to.
+    if(demote(pagetable, va, 0) != 0)
+      return -1;
+  }
+
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  // if no one else shares the page any more, just
+  // make it writable again.
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault by user code at va; write is set
+// for a store. sz is the size of the process's memory.
+// Either va lies below sz but sbrk() never allocated its page,
+// which is then allocated and zeroed, or it is a store to a
+// copy-on-write page, which is then copied.
+// Returns 0 if the access can be retried, or -1 if it
+// is invalid or memory is exhausted.
+int
+uvmfault(pagetable_t pagetable, uint64 va, uint64 sz, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(pagetable, va);
+    return -1;
+  }
+
+  if(va >= sz)
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  promote(pagetable, va, sz);
+  return 0;
+}
+
+// Look up the physical address of user page va for a
+// copy to (write=1) or from user memory by the kernel,
+// first doing whatever a page fault by the current process
+// would have done. Returns 0 if va is not valid user memory.
+static uint64
+uvmpa(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & (PTE_W|PTE_COW)) != PTE_W)){
+    // only the current process grows lazily or has mapped
+    // regions; exec() copies into a page table whose memory
+    // is all present. Reading a file page in would sleep,
+    // which mustn't happen while the caller holds a spinlock
+    // (interrupts off) or an inode lock, lest it deadlock.
+    if(p && p->pagetable == pagetable){
+      if(vmfault(p, va, write, intr_get() && p->nilock == 0) != 0)
+        return 0;
+    } else if(uvmfault(pagetable, va, 0, write) != 0)
+      return 0;
+  }
+  return walkaddr(pagetable, va);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -350,7 +706,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpa(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -375,7 +731,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpa(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -402,7 +758,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpa(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -18,12 +18,14 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | inode bit map |
+//                                          free bit map | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
+int nimap = NINODES/(BSIZE*8) + 1;
 int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, imap, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
@@ -34,12 +36,14 @@ uint freeblock;
 
 
 void balloc(int);
+void imap(int);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirappend(uint inum, struct dirent *de);
 void die(const char *);
 
 // convert to intel byte order
@@ -90,7 +94,7 @@ main(int argc, char *argv[])
     die(argv[1]);
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + nlog + ninodeblocks + nimap + nbitmap;
   nblocks = FSSIZE - nmeta;
 
   sb.magic = FSMAGIC;
@@ -100,10 +104,11 @@ main(int argc, char *argv[])
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.imapstart = xint(2+nlog+ninodeblocks);
+  sb.bmapstart = xint(2+nlog+ninodeblocks+nimap);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, inode map blocks %u, bitmap blocks %u) blocks %d total %d\n",
+         nmeta, nlog, ninodeblocks, nimap, nbitmap, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -120,12 +125,12 @@ main(int argc, char *argv[])
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
+  dirappend(rootino, &de);
 
   bzero(&de, sizeof(de));
   de.inum = xshort(rootino);
   strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirappend(rootino, &de);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,7 +157,7 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirappend(rootino, &de);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -163,11 +168,12 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1)/BSIZE) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
   balloc(freeblock);
+  imap(freeinode);
 
   exit(0);
 }
@@ -247,8 +253,83 @@ balloc(int used)
   wsect(sb.bmapstart, buf);
 }
 
+// Mark inodes 0..used-1 (0 is never used) in the inode map.
+void
+imap(int used)
+{
+  uchar buf[BSIZE];
+  int i;
+
+  printf("imap: first %d inodes have been allocated\n", used);
+  assert(used < BSIZE*8);
+  bzero(buf, BSIZE);
+  for(i = 0; i < used; i++){
+    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  }
+  wsect(sb.imapstart, buf);
+}
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return entry i of the block of addresses *ap (both in
+// disk byte order), allocating the block and the entry if
+// need be.
+uint
+indirect(uint *ap, uint i)
+{
+  uint a[NINDIRECT];
+
+  if(xint(*ap) == 0)
+    *ap = xint(freeblock++);
+  rsect(xint(*ap), (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(freeblock++);
+    wsect(xint(*ap), (char*)a);
+  }
+  return xint(a[i]);
+}
+
+// Return the block holding block fbn of the file, allocating
+// it if need be. Mirrors bmap() in kernel/fs.c; since mkfs
+// hands out blocks in order, most files get a single extent.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint base, x;
+  struct extent *e;
+  int i;
+
+  assert(fbn < MAXFILE);
+  base = 0;
+  e = 0;
+  for(i = 0; i < NEXTENT && xint(din->ext[i].len) > 0; i++){
+    e = &din->ext[i];
+    if(fbn < base + xint(e->len))
+      return xint(e->start) + fbn - base;
+    base += xint(e->len);
+  }
+
+  if(fbn == base && din->indirect == 0 && din->dindirect == 0){
+    if(e && xint(e->start) + xint(e->len) == freeblock){
+      e->len = xint(xint(e->len) + 1);
+      return freeblock++;
+    }
+    if(i < NEXTENT){
+      din->ext[i].start = xint(freeblock);
+      din->ext[i].len = xint(1);
+      return freeblock++;
+    }
+  }
+  fbn -= base;
+
+  if(fbn < NINDIRECT)
+    return indirect(&din->indirect, fbn);
+  fbn -= NINDIRECT;
+
+  x = xint(indirect(&din->dindirect, fbn / NINDIRECT));
+  return indirect(&x, fbn % NINDIRECT);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -256,7 +337,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -264,23 +344,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -293,6 +357,69 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// Must agree with dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDIRHASH;
+}
+
+// Add de to directory inum the way dirlink() in kernel/fs.c
+// would: in the first block while it has room, and then in
+// the blocks of the bucket that the name hashes to.
+void
+dirappend(uint inum, struct dirent *de)
+{
+  struct dinode din;
+  struct dirent d[DPB];
+  uint index[NDIRHASH];
+  uint off, fbn, x;
+  int h, i;
+
+  rinode(inum, &din);
+  off = xint(din.size);
+  if(off < BSIZE){
+    iappend(inum, de, sizeof(*de));
+    return;
+  }
+
+  if(din.dindex == 0)
+    din.dindex = xint(freeblock++);
+  rsect(xint(din.dindex), index);
+  h = dirhash(de->name);
+
+  // a free slot in the bucket? mkfs never frees entries,
+  // so only the bucket's newest block can have one.
+  if((fbn = xint(index[h])) != 0){
+    x = bmap(&din, fbn);
+    rsect(x, d);
+    for(i = 1; i < DPB; i++){
+      if(d[i].inum == 0){
+        d[i] = *de;
+        wsect(x, d);
+        return;
+      }
+    }
+  }
+
+  fbn = off / BSIZE;
+  x = bmap(&din, fbn);
+  bzero(d, sizeof(d));
+  memmove(d[0].name, &index[h], sizeof(index[h]));
+  d[1] = *de;
+  wsect(x, d);
+  index[h] = xint(fbn);
+  wsect(xint(din.dindex), index);
+  din.size = xint((fbn + 1) * BSIZE);
+  winode(inum, &din);
+}
+
 void
 die(const char *s)
 {
@@ -780,6 +780,256 @@ pipe1(char *s)
 }
 
 
+// pipesize() changes how much a pipe can buffer,
+// keeping any data already in it.
+void
+pipesz(char *s)
+{
+  enum { N=8192 };
+  int fds[2], i, n, pid, wd;
+  static char wbuf[N], rbuf[N];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(pipesize(fds[0], 0) != 4096){
+    printf("%s: default pipe size %d\n", s, pipesize(fds[0], 0));
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    wbuf[i] = i % 251;
+
+  // with no reader running, these writes block for good if
+  // the pipe holds less than it should, so a watchdog kills
+  // the test if they don't finish in time.
+  pid = getpid();
+  if((wd = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(wd == 0){
+    sleep(100);
+    printf("%s: write blocked, pipe too small\n", s);
+    kill(pid);
+    exit(1);
+  }
+  if(write(fds[1], wbuf, 3000) != 3000){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(pipesize(fds[1], N) != N){
+    printf("%s: could not grow pipe\n", s);
+    exit(1);
+  }
+  if(write(fds[1], wbuf+3000, N-3000) != N-3000){
+    printf("%s: write after resize failed\n", s);
+    exit(1);
+  }
+  kill(wd);
+  wait(0);
+  if(pipesize(fds[1], 4096) != -1){
+    printf("%s: shrank below buffered data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += n){
+    if((n = read(fds[0], rbuf+i, N-i)) <= 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  if(memcmp(wbuf, rbuf, N) != 0){
+    printf("%s: data corrupted by resize\n", s);
+    exit(1);
+  }
+  if(pipesize(fds[1], 1<<30) != -1){
+    printf("%s: huge pipe size accepted\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// splice() moves file data into a pipe and pipe data into a
+// file, and tee() duplicates pipe data, all without passing
+// it through user memory.
+void
+splicetest(char *s)
+{
+  enum { N=3000 };
+  int fd, fds[2], fds2[2], i, n;
+  static char wbuf[N], rbuf[N];
+
+  for(i = 0; i < N; i++)
+    wbuf[i] = 'a' + i % 23;
+  unlink("splice1");
+  unlink("splice2");
+  fd = open("splice1", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, wbuf, N) != N){
+    printf("%s: create splice1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) != 0 || pipe(fds2) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+
+  // file -> pipe, then end of file.
+  fd = open("splice1", O_RDONLY);
+  for(i = 0; i < N; i += n){
+    if((n = splice(fd, fds[1], N - i)) <= 0){
+      printf("%s: splice from file failed\n", s);
+      exit(1);
+    }
+  }
+  if(splice(fd, fds[1], 10) != 0){
+    printf("%s: splice past end of file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // pipe -> pipe, leaving the data in the first pipe.
+  for(i = 0; i < N; i += n){
+    if((n = tee(fds[0], fds2[1], N - i)) <= 0){
+      printf("%s: tee failed\n", s);
+      exit(1);
+    }
+    // tee() doesn't consume, so move on by hand.
+    if(read(fds[0], rbuf, n) != n){
+      printf("%s: read after tee failed\n", s);
+      exit(1);
+    }
+  }
+  if(read(fds2[0], rbuf, N) != N || memcmp(rbuf, wbuf, N) != 0){
+    printf("%s: tee copied wrong data\n", s);
+    exit(1);
+  }
+
+  // pipe -> file.
+  if(write(fds[1], wbuf, N) != N){
+    printf("%s: write to pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  fd = open("splice2", O_CREATE|O_RDWR);
+  for(i = 0; i < N; i += n){
+    if((n = splice(fds[0], fd, N - i)) <= 0){
+      printf("%s: splice to file failed\n", s);
+      exit(1);
+    }
+  }
+  if(splice(fds[0], fd, 10) != 0){
+    printf("%s: splice from closed pipe\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("splice2", O_RDONLY);
+  memset(rbuf, 0, N);
+  if(read(fd, rbuf, N) != N || memcmp(rbuf, wbuf, N) != 0){
+    printf("%s: splice wrote wrong data\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  close(fds[0]);
+  close(fds2[0]);
+  close(fds2[1]);
+  unlink("splice1");
+  unlink("splice2");
+}
+
+// splice() between pipes, racing with read() of the same
+// pipe: every byte must come out of exactly one of them.
+void
+splicerace(char *s)
+{
+  enum { N=2000, NVAL=250 };
+  int a[2], b[2], c[2], i, n, pid1, pid2, xstatus;
+  static char wbuf[N], rbuf[N];
+  int count[NVAL];
+
+  if(pipe(a) != 0 || pipe(b) != 0 || pipe(c) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(splice(a[0], a[1], 1) != -1){
+    printf("%s: splice of a pipe into itself worked\n", s);
+    exit(1);
+  }
+
+  pid1 = fork();
+  if(pid1 < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid1 == 0){
+    close(a[1]);
+    while((n = splice(a[0], b[1], 13)) > 0)
+      ;
+    exit(n == 0 ? 0 : 1);
+  }
+  pid2 = fork();
+  if(pid2 < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid2 == 0){
+    close(a[1]);
+    while((n = read(a[0], rbuf, 7)) > 0){
+      if(write(c[1], rbuf, n) != n)
+        exit(1);
+    }
+    exit(n == 0 ? 0 : 1);
+  }
+
+  close(a[0]);
+  close(b[1]);
+  close(c[1]);
+  for(i = 0; i < N; i++)
+    wbuf[i] = i % NVAL;
+  for(i = 0; i < N; i += 10){
+    if(write(a[1], wbuf + i, 10) != 10){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(a[1]);
+  for(i = 0; i < 2; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: consumer failed\n", s);
+      exit(1);
+    }
+  }
+
+  memset(count, 0, sizeof(count));
+  i = 0;
+  while((n = read(b[0], rbuf, N)) > 0){
+    i += n;
+    while(n-- > 0)
+      count[(uchar)rbuf[n] % NVAL]++;
+  }
+  while((n = read(c[0], rbuf, N)) > 0){
+    i += n;
+    while(n-- > 0)
+      count[(uchar)rbuf[n] % NVAL]++;
+  }
+  close(b[0]);
+  close(c[0]);
+  if(i != N){
+    printf("%s: %d bytes came out, not %d\n", s, i, N);
+    exit(1);
+  }
+  for(i = 0; i < NVAL; i++){
+    if(count[i] != N / NVAL){
+      printf("%s: byte %d came out %d times\n", s, i, count[i]);
+      exit(1);
+    }
+  }
+}
+
 // test if child is killed (status = -1)
 void
 killstatus(char *s)
@@ -1948,6 +2198,76 @@ rmdot(char *s)
   }
 }
 
+// the kernel caches directory lookups, including failed ones;
+// check that creating and removing names updates it, and that
+// a directory that reuses a freed one's inode starts afresh.
+void
+dcache(char *s)
+{
+  int fd;
+
+  if(mkdir("dcd") != 0){
+    printf("%s: mkdir dcd failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/x", O_RDONLY) >= 0){
+    printf("%s: open nonexistent dcd/x worked\n", s);
+    exit(1);
+  }
+  fd = open("dcd/x", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create dcd/x failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dcd/x", O_RDONLY)) < 0){
+    printf("%s: open dcd/x after create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dcd/x") != 0){
+    printf("%s: unlink dcd/x failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/x", O_RDONLY) >= 0){
+    printf("%s: open dcd/x after unlink worked\n", s);
+    exit(1);
+  }
+
+  // remember dcd/sub/.. and free dcd/sub; a new directory in /
+  // may well get its inode, and its .. must be /.
+  if(mkdir("dcd/sub") != 0){
+    printf("%s: mkdir dcd/sub failed\n", s);
+    exit(1);
+  }
+  if((fd = open("dcd/sub/..", O_RDONLY)) < 0){
+    printf("%s: open dcd/sub/.. failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dcd/sub") != 0){
+    printf("%s: unlink dcd/sub failed\n", s);
+    exit(1);
+  }
+  if(mkdir("dcsub") != 0){
+    printf("%s: mkdir dcsub failed\n", s);
+    exit(1);
+  }
+  fd = open("dcsub/../dcmark", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create dcsub/../dcmark failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dcmark") != 0){
+    printf("%s: dcsub/.. is not /\n", s);
+    exit(1);
+  }
+
+  unlink("dcsub");
+  unlink("dcd");
+}
+
 void
 dirfile(char *s)
 {
@@ -2204,6 +2524,542 @@ sbrkmuch(char *s)
   }
 }
 
+// sbrk() grows the address space lazily, so growing it by
+// more than physical memory succeeds, and only the pages
+// actually touched get allocated.
+void
+lazysbrk(char *s)
+{
+  enum { HUGE=1024*1024*1024 };
+  char *a, *p;
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of untouched memory failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a+HUGE; p += 4096*4096){
+    if(*p != 0){
+      printf("%s: lazily allocated page not zero\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+  // the kernel must fault pages in for system calls, too.
+  if(pipe((int*)(a + HUGE - 64)) != 0){
+    printf("%s: pipe() into untouched memory failed\n", s);
+    exit(1);
+  }
+  if(sbrk(-HUGE) != a + HUGE){
+    printf("%s: sbrk could not shrink\n", s);
+    exit(1);
+  }
+}
+
+// fork a process whose memory is more than half of
+// physical memory, which only fits if fork() shares pages
+// copy-on-write, and check that parent and child each see
+// only their own stores.
+void
+cowfork(char *s)
+{
+  enum { BIG=80*1024*1024 };
+  char *a, *p;
+  int pid, ppid, xstatus;
+
+  ppid = getpid();
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a+BIG; p += PGSIZE)
+    *(int*)p = ppid;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a+BIG; p += 64*PGSIZE){
+      if(*(int*)p != ppid){
+        printf("%s: child saw wrong value\n", s);
+        exit(1);
+      }
+      *(int*)p = getpid();
+    }
+    for(p = a; p < a+BIG; p += 64*PGSIZE){
+      if(*(int*)p != getpid()){
+        printf("%s: child lost its store\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(p = a; p < a+BIG; p += PGSIZE){
+    if(*(int*)p != ppid){
+      printf("%s: parent saw child's store\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
+// mmap() a file shared and private, and anonymous memory,
+// and check what each sees, what reaches the file, and
+// what fork() shares.
+void
+mmaptest(char *s)
+{
+  enum { SZ=2*PGSIZE+100 };
+  char *a, *b;
+  int fd, i, pid, xstatus, fds[2];
+
+  fd = open("mmapf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmapf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write mmapf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("mmapf", O_RDONLY)) < 0){
+    printf("%s: open mmapf failed\n", s);
+    exit(1);
+  }
+  if(mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+    printf("%s: writable shared mmap of read-only fd worked\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // shared: stores reach the file.
+  if((fd = open("mmapf", O_RDWR)) < 0){
+    printf("%s: open mmapf failed\n", s);
+    exit(1);
+  }
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(a[i] != 'a' + i % 23){
+      printf("%s: mapped byte %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = SZ; i < 3*PGSIZE; i++){
+    if(a[i] != 0){
+      printf("%s: byte %d past end of file not zero\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = 0; i < SZ; i += PGSIZE)
+    a[i] = 'Z';
+  if(munmap(a, SZ) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, SZ) != SZ){
+    printf("%s: read mmapf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(buf[i] != ((i % PGSIZE) == 0 ? 'Z' : 'a' + i % 23)){
+      printf("%s: shared store not in file at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  // private: stores stay in memory.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(a[PGSIZE] != 'Z' || a[PGSIZE+1] != 'a' + (PGSIZE+1) % 23){
+    printf("%s: private mapping has wrong data\n", s);
+    exit(1);
+  }
+  a[PGSIZE+1] = 'Y';
+  if(a[PGSIZE+1] != 'Y'){
+    printf("%s: private store lost\n", s);
+    exit(1);
+  }
+  munmap(a, SZ);
+  close(fd);
+  if((fd = open("mmapf", O_RDONLY)) < 0 || read(fd, buf, SZ) != SZ){
+    printf("%s: reread mmapf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[PGSIZE+1] != 'a' + (PGSIZE+1) % 23){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+
+  // pipe and file I/O to and from pages not yet faulted in.
+  if((fd = open("mmapf", O_RDWR)) < 0 || pipe(fds) < 0){
+    printf("%s: open mmapf or pipe failed\n", s);
+    exit(1);
+  }
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + PGSIZE, 10) != 10 || read(fds[0], a + 2*PGSIZE, 10) != 10){
+    printf("%s: pipe I/O on mapped file failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a, 10) != 10){
+    printf("%s: read of file into its own mapping failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    if(a[2*PGSIZE+i] != a[PGSIZE+i] || a[i] != buf[i]){
+      printf("%s: I/O on mapped file has wrong data\n", s);
+      exit(1);
+    }
+  }
+  munmap(a, SZ);
+  close(fds[0]);
+  close(fds[1]);
+  close(fd);
+
+  // stores past the end of the file don't outlive it.
+  if((fd = open("mmapf", O_RDWR)) < 0){
+    printf("%s: open mmapf failed\n", s);
+    exit(1);
+  }
+  a = mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap past end failed\n", s);
+    exit(1);
+  }
+  a[SZ] = 'X';
+  a[3*PGSIZE] = 'X';
+  munmap(a, 4*PGSIZE);
+  close(fd);
+  if((fd = open("mmapf", O_RDWR|O_TRUNC)) < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: rewrite mmapf failed\n", s);
+    exit(1);
+  }
+  a = mmap(0, 4*PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap past end failed\n", s);
+    exit(1);
+  }
+  if(a[SZ] != 0 || a[3*PGSIZE] != 0){
+    printf("%s: store past end of file survived truncation\n", s);
+    exit(1);
+  }
+  munmap(a, 4*PGSIZE);
+  close(fd);
+  unlink("mmapf");
+
+  // anonymous, and a hole punched in it.
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap anon failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*PGSIZE; i++){
+    if(a[i] != 0){
+      printf("%s: anon memory not zero\n", s);
+      exit(1);
+    }
+    a[i] = i;
+  }
+  if(munmap(a + PGSIZE, PGSIZE) != 0){
+    printf("%s: munmap middle failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 0 || a[2*PGSIZE+1] != (char)(2*PGSIZE+1)){
+    printf("%s: munmap middle lost the rest\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[PGSIZE] = 1;  // should be killed
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus == 0){
+    printf("%s: store to unmapped page worked\n", s);
+    exit(1);
+  }
+  munmap(a, PGSIZE);
+  munmap(a + 2*PGSIZE, PGSIZE);
+
+  // shared anonymous memory is shared with children.
+  b = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+  if(b == MAP_FAILED){
+    printf("%s: mmap shared anon failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    b[10] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || b[10] != 'c'){
+    printf("%s: child's store to shared anon memory not seen\n", s);
+    exit(1);
+  }
+  munmap(b, PGSIZE);
+}
+
+// take a fresh snapshot of the statistics device, and
+// return a pointer just past key in it, or 0.
+char *
+statfind(char *key)
+{
+  static char sbuf[4096+1];
+  int fd, i, n, m;
+  char *p;
+
+  if((fd = open("statistics", O_RDONLY)) < 0)
+    return 0;
+  // the first pass uses up any snapshot left part-read.
+  for(i = 0; i < 2; i++){
+    n = 0;
+    while((m = read(fd, sbuf+n, sizeof(sbuf)-1-n)) > 0)
+      n += m;
+  }
+  close(fd);
+  sbuf[n] = 0;
+  m = strlen(key);
+  for(p = sbuf; *p; p++)
+    if(memcmp(p, key, m) == 0)
+      return p + m;
+  return 0;
+}
+
+// the number after key in the statistics, or -1.
+int
+statnum(char *key)
+{
+  char *p;
+
+  if((p = statfind(key)) == 0)
+    return -1;
+  return atoi(p);
+}
+
+// fill enough heap to make superpages of it, and check that
+// the data survives, that fork() copies it on write, and that
+// giving back half of a superpage keeps the other half.
+// The vm counters in statistics show that each of those
+// went through the superpage code.
+void
+superpg(char *s)
+{
+  char *a, *lo, *hi, *p;
+  uint64 top;
+  int pid, xstatus, n, d;
+
+  if((n = statnum("promote ")) < 0){
+    printf("%s: no superpage counters in statistics\n", s);
+    exit(1);
+  }
+  a = sbrk(0);
+  lo = (char*)SUPERPGROUNDUP((uint64)a);
+  hi = lo + 2*SUPERPGSIZE;
+  if(sbrk(hi - a) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < hi; p += PGSIZE)
+    *(uint64*)p = (uint64)p;
+  for(p = a; p < hi; p += PGSIZE){
+    if(*(uint64*)p != (uint64)p){
+      printf("%s: lost a store at %p\n", s, p);
+      exit(1);
+    }
+  }
+  if(statnum("promote ") < n + 2){
+    printf("%s: no superpages formed\n", s);
+    exit(1);
+  }
+
+  n = statnum("share ");
+  d = statnum("demote ");
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = lo; p < hi; p += 7*PGSIZE)
+      *(uint64*)p = 0;
+    for(p = lo; p < hi; p += PGSIZE){
+      if(*(uint64*)p != ((p - lo) % (7*PGSIZE) == 0 ? 0 : (uint64)p)){
+        printf("%s: child sees wrong data at %p\n", s, p);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  if(statnum("share ") < n + 2){
+    printf("%s: fork didn't share the superpages\n", s);
+    exit(1);
+  }
+  if(statnum("demote ") < d + 1){
+    printf("%s: child's store didn't split a superpage\n", s);
+    exit(1);
+  }
+  for(p = lo; p < hi; p += PGSIZE){
+    if(*(uint64*)p != (uint64)p){
+      printf("%s: parent sees child's store at %p\n", s, p);
+      exit(1);
+    }
+  }
+
+  // keep the first half of the first superpage. The child
+  // is gone, so the page at the cut can hold the page table.
+  n = statnum("reuse ");
+  top = (uint64)lo + SUPERPGSIZE/2;
+  sbrk(top - (uint64)hi);
+  if(statnum("reuse ") < n + 1){
+    printf("%s: shrink didn't split the superpage in place\n", s);
+    exit(1);
+  }
+  for(p = lo; p < (char*)top; p += PGSIZE){
+    if(*(uint64*)p != (uint64)p){
+      printf("%s: shrinking lost data at %p\n", s, p);
+      exit(1);
+    }
+  }
+  sbrk(SUPERPGSIZE);
+  for(p = (char*)top; p < (char*)top + SUPERPGSIZE; p += PGSIZE){
+    if(*(uint64*)p != 0){
+      printf("%s: regrown memory not zero at %p\n", s, p);
+      exit(1);
+    }
+  }
+  sbrk(a - sbrk(0));
+}
+
+// pages free in blocks big enough for a superpage, from
+// the "blocks" line of statistics, or -1.
+int
+bigfree(void)
+{
+  char *p;
+  int i, n;
+
+  if((p = statfind("blocks")) == 0)
+    return -1;
+  n = 0;
+  for(i = 0; *p == ' '; i++){
+    p++;
+    if(i >= SUPERPGORDER)
+      n += atoi(p) << i;
+    while(*p >= '0' && *p <= '9')
+      p++;
+  }
+  return n;
+}
+
+// children that take memory a page at a time split the
+// allocator's big blocks; once they exit, the pages should
+// coalesce back into blocks big enough for superpages.
+void
+buddy(char *s)
+{
+  enum { NCHILD = 4, SZ = 8*SUPERPGSIZE, SLACK = 4*SUPERPGSIZE/PGSIZE };
+  int ready[2], go[2];
+  int before, during, after, unusable, i, pid, xstatus;
+  char *a, *p, c;
+
+  before = bigfree();
+  unusable = statnum("unusable for superpage ");
+  if(before < 0 || unusable < 0){
+    printf("%s: no block counts in statistics\n", s);
+    exit(1);
+  }
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(go[1]);
+      a = sbrk(SZ);
+      if(a == (char*)0xffffffffffffffffL){
+        write(ready[1], "f", 1);
+        exit(1);
+      }
+      // every other page, so that none of it is promoted.
+      for(p = a; p < a + SZ; p += 2*PGSIZE)
+        *p = 1;
+      write(ready[1], "x", 1);
+      read(go[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1 || c != 'x'){
+      printf("%s: child's sbrk failed\n", s);
+      exit(1);
+    }
+  }
+  during = bigfree();
+  close(go[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  close(ready[0]);
+  close(go[0]);
+  after = bigfree();
+
+  if(during > before - SLACK){
+    printf("%s: big blocks not split (%d then %d pages)\n", s, before, during);
+    exit(1);
+  }
+  if(after < before - SLACK){
+    printf("%s: freed pages didn't coalesce (%d, %d, then %d pages)\n",
+           s, before, during, after);
+    exit(1);
+  }
+  if(statnum("unusable for superpage ") > unusable + 10){
+    printf("%s: free memory left fragmented\n", s);
+    exit(1);
+  }
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2855,6 +3711,11 @@ main(int argc, char *argv[])
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {lazysbrk, "lazysbrk"},
+    {cowfork, "cowfork"},
+    {mmaptest, "mmaptest"},
+    {superpg, "superpg"},
+    {buddy, "buddy"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
@@ -2871,10 +3732,14 @@ main(int argc, char *argv[])
     {iputtest, "iput"},
     {mem, "mem"},
     {pipe1, "pipe1"},
+    {pipesz, "pipesz"},
+    {splicetest, "splice"},
+    {splicerace, "splicerace"},
     {killstatus, "killstatus"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
+    {dcache, "dcache"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
     {dirfile, "dirfile"},
@@ -36,3 +36,8 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("pipesize");
+entry("splice");
+entry("tee");
+entry("mmap");
+entry("munmap");